@@ -0,0 +1,123 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fat.h"
+
+// Checks every FAT codec this CPU runs against the scalar reference, then
+// reports its decode and encode throughput.
+//   bench_fat_table [entries] [runs]
+
+static const char *type_names[] = { "FAT12", "FAT16", "FAT32" };
+static const uint32_t masks[] = { 0xFFF, 0xFFFF, 0xFFFFFFFF };
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t packed_size(fat_t type, size_t n) {
+  return type == FAT12 ? n / 2 * 3 : type == FAT16 ? n * 2 : n * 4;
+}
+
+// Every length up to 100 runs the vector loops and their scalar tails.
+static int validate(fat_t type, const fat_codec_t *codec, const fat_codec_t *ref,
+                    const uint32_t *entries, const uint8_t *packed, size_t n) {
+  uint32_t *decoded = malloc(n * sizeof(uint32_t) + 64);
+  uint8_t *encoded = malloc(packed_size(type, n) + 64);
+  size_t len;
+  int ok = 1;
+
+  for (len = 0; len <= n && ok; len = len < 100 ? len + (type == FAT12 ? 2 : 1) : len == n ? n + 1 : n) {
+    uint8_t *expected = malloc(packed_size(type, len) + 1);
+    ref->encode(entries, expected, len);
+    memset(decoded, 0xAA, len * sizeof(uint32_t) + 64);
+    memset(encoded, 0xAA, packed_size(type, len) + 64);
+    codec->decode(packed, decoded, len);
+    codec->encode(entries, encoded, len);
+    size_t i;
+    for (i = 0; i < len && ok; i++) {
+      if (decoded[i] != (entries[i] & masks[type])) {
+        printf("%s %s : decode mismatch at %zu of %zu\n", type_names[type], codec->name, i, len);
+        ok = 0;
+      }
+    }
+    if (ok && memcmp(encoded, expected, packed_size(type, len)) != 0) {
+      printf("%s %s : encode mismatch, %zu entries\n", type_names[type], codec->name, len);
+      ok = 0;
+    }
+    if (ok && (decoded[len] != 0xAAAAAAAA || encoded[packed_size(type, len)] != 0xAA)) {
+      printf("%s %s : writes past the end, %zu entries\n", type_names[type], codec->name, len);
+      ok = 0;
+    }
+    free(expected);
+  }
+  free(decoded);
+  free(encoded);
+  return ok;
+}
+
+int main(int argc, char *argv[]) {
+  size_t n = argc > 1 ? strtoul(argv[1], NULL, 0) : 1 << 24;
+  int runs = argc > 2 ? atoi(argv[2]) : 5;
+  int failed = 0;
+  int t;
+
+  n &= ~(size_t) 1;
+  uint32_t *entries = malloc(n * sizeof(uint32_t));
+  uint32_t *decoded = malloc(n * sizeof(uint32_t));
+  uint8_t *packed = malloc(n * 4);
+  size_t i;
+
+  srand(1);
+  for (i = 0; i < n; i++)
+    entries[i] = ((uint32_t) rand() << 16) ^ (uint32_t) rand();
+
+  printf("%zu entries, best of %d runs\n", n, runs);
+  printf("%-6s %-7s %14s %14s\n", "type", "codec", "decode MB/s", "encode MB/s");
+  for (t = FAT12; t <= FAT32; t++) {
+    const fat_codec_t *codecs;
+    int n_codecs = fat_codecs(t, &codecs);
+    const fat_codec_t *ref = &codecs[n_codecs - 1];
+    int c;
+
+    ref->encode(entries, packed, n);
+    for (c = 0; c < n_codecs; c++) {
+      const fat_codec_t *codec = &codecs[c];
+      if (!fat_codec_supported(codec)) {
+        printf("%-6s %-7s %14s %14s\n", type_names[t], codec->name, "-", "-");
+        continue;
+      }
+      if (!validate(t, codec, ref, entries, packed, n)) {
+        failed = 1;
+        continue;
+      }
+
+      double best_decode = 1e9, best_encode = 1e9;
+      int r;
+      for (r = 0; r < runs; r++) {
+        double start = now();
+        codec->decode(packed, decoded, n);
+        double middle = now();
+        codec->encode(decoded, packed, n);
+        double end = now();
+        if (middle - start < best_decode)
+          best_decode = middle - start;
+        if (end - middle < best_encode)
+          best_encode = end - middle;
+      }
+      // Throughput of the on-disk table.
+      double mb = packed_size(t, n) / 1e6;
+      printf("%-6s %-7s %14.0f %14.0f%s\n", type_names[t], codec->name, mb / best_decode, mb / best_encode,
+             codec == fat_codec(t) ? "  (used)" : "");
+    }
+  }
+
+  free(entries);
+  free(decoded);
+  free(packed);
+  return failed;
+}
@@ -0,0 +1,376 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "fat.h"
+
+// Scaling benchmark : formats a sparse FAT32 image, mounts it with the
+// daemon, and drives the mount with 1, 2, 4 ... N threads through plain
+// system calls. Every mix reports throughput and p50/p99 latency per thread
+// count. The mount uses direct_io and no attribute caching, so that every
+// call reaches the daemon.
+//   bench_scaling [-b daemon] [-t max threads] [-d seconds per run] [-s image MiB] [-w work dir]
+
+static struct {
+  const char *daemon;
+  int max_threads;
+  double seconds;
+  unsigned int image_mib;
+  char image[1024];
+  char mnt[1024];
+} bench = { "./fat", 0, 2.0, 4096 };
+
+#define FILE_MIB 32              // per reader thread
+#define READ_SIZE (128 << 10)    // sequential reads
+#define STAT_FILES 2000          // getattr storm
+#define CREATES 8000             // per run, split between the threads
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// FAT32, 4 KiB clusters, root directory in cluster 2. Unwritten parts of the
+// file are holes, so the image costs next to nothing. The type follows the
+// cluster count, so anything under 256 MiB would mount as FAT16.
+static int format_image(const char *path, unsigned int mib) {
+  const uint32_t bps = 512, spc = 8, reserved = 32;
+  uint32_t total = (uint32_t)((uint64_t) mib * 1024 * 1024 / bps);
+  uint32_t clusters = total / spc;
+  uint32_t fat_sectors = (clusters * 4 + bps - 1) / bps;
+  uint8_t sector[512];
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+  if (fd < 0 || ftruncate(fd, (off_t) total * bps) != 0)
+    return -1;
+
+  memset(sector, 0, sizeof(sector));
+  fat_BS_t *bs = (fat_BS_t*) sector;
+  fat_extended_BIOS_32_t *ext = (fat_extended_BIOS_32_t*)(sector + sizeof(fat_BS_t));
+  memcpy(bs->bootjmp, "\xEB\x58\x90", 3);
+  memcpy(bs->oem_name, "FUSEFAT ", 8);
+  bs->bytes_per_sector = bps;
+  bs->sectors_per_cluster = spc;
+  bs->reserved_sector_count = reserved;
+  bs->table_count = 2;
+  bs->media_type = 0xF8;
+  bs->sectors_per_track = 32;
+  bs->head_side_count = 64;
+  bs->total_sectors_32 = total;
+  ext->table_size_32 = fat_sectors;
+  ext->cluster_root_dir = 2;
+  ext->sector_fs_info = 1;
+  ext->sector_bs_backup = 6;
+  ext->bios_drive_num = 0x80;
+  ext->ext_boot_signature = 0x29;
+  ext->volume_id = 0xBE7C4;
+  memcpy(ext->volume_label, "BENCH      ", 11);
+  memcpy(ext->fat_type_label, "FAT32   ", 8);
+  ext->boot_sector_sign = 0xAA55;
+  if (pwrite(fd, sector, bps, 0) != (ssize_t) bps)
+    return -1;
+
+  fat_fs_info_t fs_info;
+  memset(&fs_info, 0, sizeof(fs_info));
+  fs_info.lead_signature = FS_INFO_LEAD_SIGNATURE;
+  fs_info.struct_signature = FS_INFO_STRUCT_SIGNATURE;
+  fs_info.free_count = FS_INFO_UNKNOWN;
+  fs_info.next_free = FS_INFO_UNKNOWN;
+  fs_info.trail_signature = FS_INFO_TRAIL_SIGNATURE;
+  if (pwrite(fd, &fs_info, sizeof(fs_info), bps) != (ssize_t) sizeof(fs_info))
+    return -1;
+
+  // Media, reserved, and the root directory's single cluster.
+  uint32_t head[3] = { 0x0FFFFFF8, 0x0FFFFFFF, 0x0FFFFFFF };
+  int i;
+  for (i = 0; i < 2; i++) {
+    if (pwrite(fd, head, sizeof(head), (off_t)(reserved + i * fat_sectors) * bps) != (ssize_t) sizeof(head))
+      return -1;
+  }
+  return close(fd);
+}
+
+static pid_t mount_image() {
+  struct stat parent, mnt;
+  char dir[4096];
+  pid_t pid = fork();
+
+  if (pid == 0) {
+    char device[4200];
+    snprintf(device, sizeof(device), "-device=%s", bench.image);
+    execl(bench.daemon, bench.daemon, device, bench.mnt, "-f",
+          "-o", "direct_io,attr_timeout=0,entry_timeout=0,negative_timeout=0", (char*) NULL);
+    perror(bench.daemon);
+    _exit(127);
+  }
+
+  snprintf(dir, sizeof(dir), "%s/..", bench.mnt);
+  double deadline = now() + 10;
+  while (now() < deadline) {
+    if (stat(dir, &parent) == 0 && stat(bench.mnt, &mnt) == 0 && parent.st_dev != mnt.st_dev)
+      return pid;
+    if (waitpid(pid, NULL, WNOHANG) == pid)
+      return -1;
+    usleep(10000);
+  }
+  kill(pid, SIGTERM);
+  return -1;
+}
+
+static void unmount_image(pid_t pid) {
+  char cmd[8400];
+  snprintf(cmd, sizeof(cmd), "fusermount -u %s 2>/dev/null || fusermount3 -u %s 2>/dev/null || umount %s",
+           bench.mnt, bench.mnt, bench.mnt);
+  if (system(cmd) != 0)
+    kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+}
+
+typedef enum {
+  MIX_SEQ_READ,
+  MIX_RAND_READ,
+  MIX_GETATTR,
+  MIX_CREATE,
+  MIXES
+} mix_t;
+
+static const char *mix_names[MIXES] = { "seq read", "rand 4k read", "getattr", "create" };
+
+typedef struct _worker {
+  pthread_t thread;
+  mix_t mix;
+  int id;
+  int n_threads;
+  pthread_barrier_t *barrier;
+  uint32_t *latencies;     // ns
+  size_t n_latencies;
+  size_t capacity;
+  uint64_t bytes;
+  int errors;
+} worker_t;
+
+static void add_latency(worker_t *w, double seconds) {
+  if (w->n_latencies == w->capacity) {
+    w->capacity = w->capacity ? w->capacity * 2 : 4096;
+    w->latencies = realloc(w->latencies, sizeof(uint32_t) * w->capacity);
+  }
+  w->latencies[w->n_latencies++] = seconds * 1e9 > UINT32_MAX ? UINT32_MAX : seconds * 1e9;
+}
+
+static void * worker_run(void *arg) {
+  worker_t *w = arg;
+  char path[4200];
+  char *buffer = malloc(READ_SIZE);
+  unsigned int seed = w->id * 7919 + 1;
+  int fd = -1;
+
+  if (w->mix == MIX_SEQ_READ || w->mix == MIX_RAND_READ) {
+    snprintf(path, sizeof(path), "%s/read/f%03d", bench.mnt, w->id);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+      w->errors++;
+  }
+
+  pthread_barrier_wait(w->barrier);
+  double end = now() + bench.seconds;
+  off_t offset = 0;
+  int i = 0;
+
+  while (fd >= 0 || w->mix == MIX_GETATTR || w->mix == MIX_CREATE) {
+    double start = now();
+    if (w->mix == MIX_CREATE && i >= CREATES / w->n_threads)
+      break;
+    if (w->mix != MIX_CREATE && start >= end)
+      break;
+
+    ssize_t r = 0;
+    if (w->mix == MIX_SEQ_READ) {
+      r = pread(fd, buffer, READ_SIZE, offset);
+      offset = r == READ_SIZE ? offset + READ_SIZE : 0;
+    } else if (w->mix == MIX_RAND_READ) {
+      off_t block = rand_r(&seed) % ((off_t) FILE_MIB * 256);
+      r = pread(fd, buffer, 4096, block * 4096);
+    } else if (w->mix == MIX_GETATTR) {
+      struct stat st;
+      snprintf(path, sizeof(path), "%s/stat/s%05d", bench.mnt, rand_r(&seed) % STAT_FILES);
+      r = stat(path, &st) == 0 ? 0 : -1;
+    } else {
+      snprintf(path, sizeof(path), "%s/create%d/t%02d_%06d", bench.mnt, w->n_threads, w->id, i);
+      int cfd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+      r = cfd >= 0 ? close(cfd) : -1;
+    }
+    add_latency(w, now() - start);
+    if (r < 0)
+      w->errors++;
+    else
+      w->bytes += r;
+    i++;
+  }
+
+  if (fd >= 0)
+    close(fd);
+  free(buffer);
+  return NULL;
+}
+
+static int compare_latency(const void *a, const void *b) {
+  uint32_t la = *(const uint32_t*) a, lb = *(const uint32_t*) b;
+  return la < lb ? -1 : la > lb;
+}
+
+static void run_mix(mix_t mix, int n_threads) {
+  worker_t *workers = calloc(n_threads, sizeof(worker_t));
+  pthread_barrier_t barrier;
+  char path[4200];
+  int i;
+
+  if (mix == MIX_CREATE) {
+    snprintf(path, sizeof(path), "%s/create%d", bench.mnt, n_threads);
+    mkdir(path, 0755);
+  }
+
+  pthread_barrier_init(&barrier, NULL, n_threads + 1);
+  for (i = 0; i < n_threads; i++) {
+    workers[i].mix = mix;
+    workers[i].id = i;
+    workers[i].n_threads = n_threads;
+    workers[i].barrier = &barrier;
+    pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+  }
+  pthread_barrier_wait(&barrier);
+  double start = now();
+  for (i = 0; i < n_threads; i++)
+    pthread_join(workers[i].thread, NULL);
+  double elapsed = now() - start;
+  pthread_barrier_destroy(&barrier);
+
+  size_t n = 0, k = 0;
+  uint64_t bytes = 0;
+  int errors = 0;
+  for (i = 0; i < n_threads; i++) {
+    n += workers[i].n_latencies;
+    bytes += workers[i].bytes;
+    errors += workers[i].errors;
+  }
+  uint32_t *all = malloc(sizeof(uint32_t) * (n + 1));
+  for (i = 0; i < n_threads; i++) {
+    memcpy(all + k, workers[i].latencies, sizeof(uint32_t) * workers[i].n_latencies);
+    k += workers[i].n_latencies;
+    free(workers[i].latencies);
+  }
+  qsort(all, n, sizeof(uint32_t), compare_latency);
+
+  printf("%-13s %7d %12.0f %10.1f %10.1f %10.1f", mix_names[mix], n_threads, n / elapsed,
+         bytes / elapsed / 1e6, n ? all[n / 2] / 1e3 : 0, n ? all[n * 99 / 100] / 1e3 : 0);
+  if (errors)
+    printf("  (%d errors)", errors);
+  printf("\n");
+  fflush(stdout);
+  free(all);
+  free(workers);
+}
+
+// Files for the readers, one per thread, and the getattr directory.
+static int populate() {
+  char path[4200];
+  char *buffer = malloc(1 << 20);
+  int i, j;
+
+  memset(buffer, 0x5A, 1 << 20);
+  snprintf(path, sizeof(path), "%s/read", bench.mnt);
+  if (mkdir(path, 0755) != 0)
+    return -1;
+  for (i = 0; i < bench.max_threads; i++) {
+    snprintf(path, sizeof(path), "%s/read/f%03d", bench.mnt, i);
+    int fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0)
+      return -1;
+    for (j = 0; j < FILE_MIB; j++) {
+      if (pwrite(fd, buffer, 1 << 20, (off_t) j << 20) != 1 << 20)
+        return -1;
+    }
+    close(fd);
+  }
+  snprintf(path, sizeof(path), "%s/stat", bench.mnt);
+  if (mkdir(path, 0755) != 0)
+    return -1;
+  for (i = 0; i < STAT_FILES; i++) {
+    snprintf(path, sizeof(path), "%s/stat/s%05d", bench.mnt, i);
+    int fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0)
+      return -1;
+    close(fd);
+  }
+  free(buffer);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  const char *work = "/tmp";
+  int opt, t;
+  mix_t mix;
+
+  while ((opt = getopt(argc, argv, "b:t:d:s:w:")) != -1) {
+    switch (opt) {
+    case 'b': bench.daemon = optarg; break;
+    case 't': bench.max_threads = atoi(optarg); break;
+    case 'd': bench.seconds = atof(optarg); break;
+    case 's': bench.image_mib = atoi(optarg); break;
+    case 'w': work = optarg; break;
+    default:
+      fprintf(stderr, "usage: %s [-b daemon] [-t max threads] [-d seconds] [-s image MiB] [-w work dir]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (bench.max_threads <= 0)
+    bench.max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (bench.image_mib < 512 || bench.image_mib < (unsigned int) bench.max_threads * FILE_MIB * 2) {
+    fprintf(stderr, "Image too small for FAT32 and %d reader files\n", bench.max_threads);
+    return 2;
+  }
+
+  snprintf(bench.image, sizeof(bench.image), "%s/bench_scaling.img", work);
+  snprintf(bench.mnt, sizeof(bench.mnt), "%s/bench_scaling.mnt", work);
+  mkdir(bench.mnt, 0755);
+  if (format_image(bench.image, bench.image_mib) != 0) {
+    fprintf(stderr, "Cannot create %s : %s\n", bench.image, strerror(errno));
+    return 1;
+  }
+  pid_t pid = mount_image();
+  if (pid < 0) {
+    fprintf(stderr, "Cannot mount %s on %s with %s\n", bench.image, bench.mnt, bench.daemon);
+    unlink(bench.image);
+    rmdir(bench.mnt);
+    return 1;
+  }
+
+  int ret = 0;
+  if (populate() != 0) {
+    fprintf(stderr, "Cannot populate %s : %s\n", bench.mnt, strerror(errno));
+    ret = 1;
+  } else {
+    printf("%u MiB image, up to %d threads, %.1f s per run\n", bench.image_mib, bench.max_threads, bench.seconds);
+    printf("%-13s %7s %12s %10s %10s %10s\n", "mix", "threads", "ops/s", "MB/s", "p50 us", "p99 us");
+    for (mix = 0; mix < MIXES; mix++) {
+      for (t = 1; t < bench.max_threads; t *= 2)
+        run_mix(mix, t);
+      run_mix(mix, bench.max_threads);
+    }
+  }
+
+  unmount_image(pid);
+  unlink(bench.image);
+  rmdir(bench.mnt);
+  return ret;
+}
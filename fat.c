@@ -1,1007 +1,3965 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
 #include <fuse.h>
+#include <stdarg.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
 #include <unistd.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <zlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "fat.h"
 
 struct fat_options
 {
   char* device;
+  int defrag;                 // run the online defragmenter
+  unsigned int defrag_rate;   // its copy rate limit, in MiB/s
+  int fsck;                   // check the volume instead of mounting it (2 : repair)
+  unsigned int fsck_threads;
+  char* journal;              // metadata intent log sidecar file
+  int ramdisk;                // work on an in-memory copy of the image
+  int odirect;                // bypass the host page cache (O_DIRECT)
+  int readonly;               // serve from an index built at mount
+  char* index;                // sidecar file keeping that index across mounts
+  int lazy_mirror;            // write the active FAT only, mirrors on flush
+  char* trace;                // record every operation to this file
+  char* replay;               // run a recorded trace instead of mounting
 } options;
 
 static struct fuse_opt fat_fuse_opts[] =
 {
   { "-device=%s", offsetof(struct fat_options, device), 0 },
+  { "defrag", offsetof(struct fat_options, defrag), 1 },
+  { "defrag_rate=%u", offsetof(struct fat_options, defrag_rate), 0 },
+  { "-fsck", offsetof(struct fat_options, fsck), 1 },
+  { "-fsck-repair", offsetof(struct fat_options, fsck), 2 },
+  { "-fsck-threads=%u", offsetof(struct fat_options, fsck_threads), 0 },
+  { "journal=%s", offsetof(struct fat_options, journal), 0 },
+  { "ramdisk", offsetof(struct fat_options, ramdisk), 1 },
+  { "odirect", offsetof(struct fat_options, odirect), 1 },
+  { "ro", offsetof(struct fat_options, readonly), 1 },
+  { "index=%s", offsetof(struct fat_options, index), 0 },
+  { "lazy_mirror", offsetof(struct fat_options, lazy_mirror), 1 },
+  { "trace=%s", offsetof(struct fat_options, trace), 0 },
+  { "-replay=%s", offsetof(struct fat_options, replay), 0 },
+  FUSE_OPT_END
 };
 
 FILE* debug;
 
 static fat_info_t fat_info;
 
-static void write_data(void * buf, size_t count, off_t offset) {
-  int fd = open(options.device, O_WRONLY);
-  pwrite(fd, buf, count, offset);
-  close(fd);
+// The clusters are split into allocation groups, each with its own lock,
+// free count and search hint. A group lock protects the file_alloc_table
+// entries of the group. Group boundaries are multiples of ALLOC_GROUP_MIN
+// cluster numbers (the first group starts at 2), so two groups never share a
+// FAT sector. Operations spanning the whole FAT
+// (reclaiming, defragmenting) take every lock, in order.
+#define ALLOC_GROUP_MIN 4096
+#define ALLOC_GROUPS_MAX 64
+typedef struct _alloc_group {
+  pthread_mutex_t lock;
+  uint32_t start;          // first cluster
+  uint32_t end;            // past the last cluster
+  uint32_t free;
+  uint32_t next;           // where the next search starts
+} alloc_group_t;
+
+static alloc_group_t *alloc_groups;
+static uint32_t n_alloc_groups;
+static uint32_t alloc_group_size;
+static unsigned int next_alloc_group;   // round robin for new files
+
+// Writers to one file are serialized, writers to different files are not.
+// Striped by first cluster.
+#define FILE_LOCKS 256
+static pthread_mutex_t file_locks[FILE_LOCKS];
+
+// Chains of deleted files, freed by the reclaimer thread.
+typedef struct _reclaim_chain {
+  uint32_t cluster;
+  struct _reclaim_chain *next;
+} reclaim_chain_t;
+
+// Data I/O holds it shared, the defragmenter takes it exclusively to switch a
+// file over to its new clusters.
+static pthread_rwlock_t relocate_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+#define DEFRAG_INTERVAL 600
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int running;
+  pthread_t thread;
+  uint32_t moving;         // first cluster of the file being copied, 0 if none
+  int moving_dirty;        // that file was written during the copy
+} defrag = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 };
+
+#define RECLAIM_BATCH 4096
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  reclaim_chain_t *head;
+  reclaim_chain_t *tail;
+  int running;
+  pthread_t thread;
+} reclaimer = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0 };
+
+// Last directory decoded by getattr. A listing is usually followed by a
+// getattr for every name in it (ls -l, find), those are answered from here
+// instead of walking the whole path again. Any metadata change drops it.
+// Directories are decoded without the lock, and only installed if nothing
+// was dropped meanwhile.
+static struct {
+  pthread_mutex_t lock;
+  char path[PATH_MAX];
+  directory_t *dir;
+  uint64_t generation;     // bumped by every drop
+} dir_cache = { PTHREAD_MUTEX_INITIALIZER, "", NULL, 0 };
+
+// Slot maps of the most recently modified directories, most recent first.
+#define DIR_SLOTS_CACHE_SIZE 64
+static pthread_mutex_t dir_slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static dir_slots_t *dir_slots_cache = NULL;
+
+// Paths recently found missing, by hash of the folded path. Only names
+// missing from an existing directory are recorded : they can only appear
+// through add_fat_dir_entry, or through the rename of a directory, which
+// clears everything. The kernel keeps its own copy for NEGATIVE_TIMEOUT.
+#define NEG_CACHE_SIZE 4096
+#define NEGATIVE_TIMEOUT "1"
+static struct {
+  pthread_mutex_t lock;
+  uint32_t hash[NEG_CACHE_SIZE];
+  char *path[NEG_CACHE_SIZE];
+} neg_cache = { PTHREAD_MUTEX_INITIALIZER };
+
+// Largest request the kernel is asked to send (FUSE 3), libfuse derives
+// max_pages from it.
+#define FAT_MAX_WRITE (1 << 20)
+
+#if FUSE_USE_VERSION >= 30
+#define FAT_FILL_DIR(filler, buf, name, st, off) filler(buf, name, st, off, FUSE_FILL_DIR_PLUS)
+#else
+#define FAT_FILL_DIR(filler, buf, name, st, off) filler(buf, name, st, off)
+#endif
+
+// Block backends. Everything that touches the volume goes through device.
+
+// File backend : the image or block device, opened once.
+static int file_fd = -1;
+
+static int file_open(const char *path) {
+  file_fd = open(path, O_RDWR);
+  return file_fd < 0 ? -1 : 0;
 }
 
-static void read_data(void * buf, size_t count, off_t offset) {
-  int fd = open(options.device, O_RDONLY);
-  pread(fd, buf, count, offset);
-  close(fd);
+static ssize_t file_read(void *buf, size_t count, off_t offset) {
+  return pread(file_fd, buf, count, offset);
 }
 
-static char * lfn_to_sfn(char * filename) {
-  char * lfn = strdup(filename);
-  char * sfn = malloc(12);
+static ssize_t file_write(const void *buf, size_t count, off_t offset) {
+  return pwrite(file_fd, buf, count, offset);
+}
 
-  // To upper case.
-  int i = 0;
-  while (lfn[i] != '\0') {
-    lfn[i] = toupper(lfn[i]);
-    i++;
-  }
+static ssize_t file_readv(const struct iovec *iov, int iovcnt, off_t offset) {
+  return preadv(file_fd, iov, iovcnt, offset);
+}
 
-  // TODO: Convert to OEM (=> '_').
+static ssize_t file_writev(const struct iovec *iov, int iovcnt, off_t offset) {
+  return pwritev(file_fd, iov, iovcnt, offset);
+}
 
-  // Strip all leading and embedded spaces
-  int j = 0;
-  i = 0;
-  while (lfn[i] != '\0') {
-    if (lfn[i] != ' ') {
-      lfn[j] = lfn[i];
-      j++;
-    }
-    i++;
-  }
-  lfn[j] = '\0';
+static int file_flush() {
+  return fdatasync(file_fd);
+}
 
-  char * ext = strrchr(lfn, '.');
-  int has_ext = (ext != NULL) && (lfn + j - ext - 1 <= 3);
-
-  if (has_ext) {
-    // Copy first 8 caracters.
-    i = 0;
-    j = 0;
-    while (&lfn[i] <= ext) {
-      if (lfn[i] != '.' && j < 8) {
-        sfn[j] = lfn[i];
-        j++;
-      }
-      i++;
-    }
-  
-    // padding
-    while (j < 8)
-      sfn[j++] = ' ';
+static off_t file_size() {
+  return lseek(file_fd, 0, SEEK_END);
+}
 
-    // Copy extension.
-    sfn[j++] = '.';
-    while (lfn[i] != '\0') {
-      sfn[j++] = lfn[i];
-      i++;
-    }
+static void file_close() {
+  close(file_fd);
+  file_fd = -1;
+}
 
-    while (j < 12)
-      sfn[j++] = ' ';
-  } else {
-    i = 0;
-    j = 0;
-    while (lfn[i] != '\0' && j < 8) {
-      if (lfn[i] != '.') {
-        sfn[j] = lfn[i];
-        j++;
+static block_backend_t file_backend = {
+  "file", file_open, file_read, file_write, file_readv, file_writev, file_flush, file_size, file_close
+};
+
+// RAM disk backend : the whole image is loaded in memory, through zlib so a
+// gzip compressed image works too, and written back on unmount if modified.
+// A path ending in .gz is written back compressed.
+static struct {
+  char *path;
+  uint8_t *data;
+  off_t size;
+  int dirty;
+  int scratch;             // a throwaway copy, never written back
+} ram;
+
+static int ram_open(const char *path) {
+  gzFile in = gzopen(path, "rb");
+  if (in == NULL)
+    return -1;
+
+  size_t size = 0, allocated = 1 << 20;
+  int n;
+  ram.data = malloc(allocated);
+  if (ram.data == NULL) {
+    gzclose(in);
+    return -1;
+  }
+  while ((n = gzread(in, ram.data + size, allocated - size > INT_MAX ? INT_MAX : allocated - size)) > 0) {
+    size += n;
+    if (size == allocated) {
+      uint8_t *data = realloc(ram.data, allocated * 2);
+      if (data == NULL) {
+        n = -1;
+        break;
       }
-      i++;
+      ram.data = data;
+      allocated *= 2;
     }
-    while (j < 12)
-      sfn[j++] = ' ';
+  }
+  gzclose(in);
+  if (n < 0) {
+    fprintf(stderr, "Cannot load %s in memory\n", path);
+    free(ram.data);
+    ram.data = NULL;
+    return -1;
   }
 
-  // TODO: numeric-tail generation.
+  ram.path = strdup(path);
+  ram.size = size;
+  ram.dirty = 0;
+  fprintf(stderr, "%ld bytes loaded in memory.\n", (long) ram.size);
+  return 0;
+}
 
-	free(lfn);
-  return sfn;
+// Reads and writes past the end of the image behave like on a file : short
+// reads, and the image grows.
+static ssize_t ram_read(void *buf, size_t count, off_t offset) {
+  if (offset >= ram.size)
+    return 0;
+  if ((off_t) count > ram.size - offset)
+    count = ram.size - offset;
+  memcpy(buf, ram.data + offset, count);
+  return count;
+}
+
+static ssize_t ram_write(const void *buf, size_t count, off_t offset) {
+  if (offset + (off_t) count > ram.size) {
+    uint8_t *data = realloc(ram.data, offset + count);
+    if (data == NULL)
+      return -1;
+    ram.data = data;
+    memset(ram.data + ram.size, 0, offset > ram.size ? offset - ram.size : 0);
+    ram.size = offset + count;
+  }
+  memcpy(ram.data + offset, buf, count);
+  ram.dirty = 1;
+  return count;
+}
+
+static ssize_t ram_readv(const struct iovec *iov, int iovcnt, off_t offset) {
+  ssize_t total = 0;
+  int i;
+  for (i = 0; i < iovcnt; i++) {
+    ssize_t n = ram_read(iov[i].iov_base, iov[i].iov_len, offset + total);
+    total += n;
+    if ((size_t) n < iov[i].iov_len)
+      break;
+  }
+  return total;
+}
+
+static ssize_t ram_writev(const struct iovec *iov, int iovcnt, off_t offset) {
+  ssize_t total = 0;
+  int i;
+  for (i = 0; i < iovcnt; i++)
+    total += ram_write(iov[i].iov_base, iov[i].iov_len, offset + total);
+  return total;
+}
+
+static int ram_flush() {
+  return 0;
 }
 
-static char * decode_long_file_name(char * name, lfn_entry_t * long_file_name) {
+static off_t ram_size() {
+  return ram.size;
+}
 
-  name[0] = long_file_name->filename1[0];
-  name[1] = long_file_name->filename1[2];
-  name[2] = long_file_name->filename1[4];
-  name[3] = long_file_name->filename1[6];
-  name[4] = long_file_name->filename1[8];
+static void ram_close() {
+  if (ram.dirty && !ram.scratch) {
+    size_t len = strlen(ram.path);
+    int ok;
+    fprintf(stderr, "Writing %ld bytes back to %s\n", (long) ram.size, ram.path);
+    if (len > 3 && strcmp(ram.path + len - 3, ".gz") == 0) {
+      gzFile out = gzopen(ram.path, "wb1");
+      off_t p = 0;
+      ok = out != NULL;
+      while (ok && p < ram.size) {
+        unsigned int n = ram.size - p > (1 << 30) ? (1 << 30) : ram.size - p;
+        ok = gzwrite(out, ram.data + p, n) == (int) n;
+        p += n;
+      }
+      if (out != NULL && gzclose(out) != Z_OK)
+        ok = 0;
+    } else {
+      int fd = open(ram.path, O_WRONLY);
+      off_t p = 0;
+      ok = fd >= 0;
+      while (ok && p < ram.size) {
+        ssize_t n = pwrite(fd, ram.data + p, ram.size - p, p);
+        ok = n > 0;
+        p += n;
+      }
+      if (fd >= 0 && (fdatasync(fd) != 0 || close(fd) != 0))
+        ok = 0;
+    }
+    if (!ok)
+      fprintf(stderr, "Cannot write the image back to %s\n", ram.path);
+  }
+  free(ram.data);
+  free(ram.path);
+  ram.data = NULL;
+}
 
-  name[5] = long_file_name->filename2[0];
-  name[6] = long_file_name->filename2[2];
-  name[7] = long_file_name->filename2[4];
-  name[8] = long_file_name->filename2[6];
-  name[9] = long_file_name->filename2[8];
-  name[10] = long_file_name->filename2[10];
+static block_backend_t ram_backend = {
+  "ramdisk", ram_open, ram_read, ram_write, ram_readv, ram_writev, ram_flush, ram_size, ram_close
+};
 
-  name[11] = long_file_name->filename3[0];
-  name[12] = long_file_name->filename3[2];
+// Direct backend : the device is opened with O_DIRECT so the host page cache
+// does not keep a second copy of what FUSE already caches. O_DIRECT needs
+// aligned offsets, lengths and buffers : aligned parts go straight to the
+// device, through a pool of aligned buffers when the caller's is not, and
+// unaligned heads and tails (directory entries, FAT sectors) go through a
+// small write-through cache of aligned blocks.
+#define DIRECT_ALIGN 4096
+#define DIRECT_POOL_BUFFERS 8
+#define DIRECT_POOL_SIZE (1 << 20)
+#define DIRECT_CACHE_BLOCKS 256
+
+static struct {
+  int fd;
+  pthread_mutex_t pool_lock;
+  pthread_cond_t pool_cond;
+  uint8_t *pool[DIRECT_POOL_BUFFERS];
+  int pool_free;                   // pool[0 .. pool_free - 1] are available
+  pthread_mutex_t cache_lock;      // also held by every write, see direct_write
+  off_t size;
+  uint8_t *blocks;
+  off_t tags[DIRECT_CACHE_BLOCKS]; // offset of the cached block, -1 if none
+} direct = { -1, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, { NULL }, 0, PTHREAD_MUTEX_INITIALIZER };
+
+static int direct_open(const char *path) {
+  int i;
+  direct.fd = open(path, O_RDWR | O_DIRECT);
+  if (direct.fd < 0)
+    return -1;
+  direct.size = lseek(direct.fd, 0, SEEK_END);
+  for (i = 0; i < DIRECT_POOL_BUFFERS; i++)
+    if (posix_memalign((void**) &direct.pool[i], DIRECT_ALIGN, DIRECT_POOL_SIZE) != 0)
+      return -1;
+  direct.pool_free = DIRECT_POOL_BUFFERS;
+  if (posix_memalign((void**) &direct.blocks, DIRECT_ALIGN, (size_t) DIRECT_CACHE_BLOCKS * DIRECT_ALIGN) != 0)
+    return -1;
+  for (i = 0; i < DIRECT_CACHE_BLOCKS; i++)
+    direct.tags[i] = -1;
+  return 0;
+}
 
-  name[13] = '\0';
+static uint8_t * direct_get_buffer() {
+  pthread_mutex_lock(&direct.pool_lock);
+  while (direct.pool_free == 0)
+    pthread_cond_wait(&direct.pool_cond, &direct.pool_lock);
+  uint8_t *buffer = direct.pool[--direct.pool_free];
+  pthread_mutex_unlock(&direct.pool_lock);
+  return buffer;
+}
 
-  return name;
+static void direct_put_buffer(uint8_t *buffer) {
+  pthread_mutex_lock(&direct.pool_lock);
+  direct.pool[direct.pool_free++] = buffer;
+  pthread_cond_signal(&direct.pool_cond);
+  pthread_mutex_unlock(&direct.pool_lock);
 }
 
-static void encode_long_file_name(char * name, lfn_entry_t * long_file_name, int n_entries) {
- // TODO: Checksum.
-  long_file_name[0].seq_number = 0x40 + n_entries;
-  int i, j;
-  int last = 0;
-  for (i = n_entries - 1; i >= 0; i--) {
-    long_file_name[i].attributes = 0x0f;
-    if (i != n_entries - 1)
-      long_file_name[i].seq_number = i + 1;
-    for (j = 0; j < 5; j++) {
-      if (last) {
-        long_file_name[i].filename1[j * 2] = 0xFF;
-        long_file_name[i].filename1[j * 2 + 1] = 0xFF;
-      } else if (name[j] != '\0') {
-        long_file_name[i].filename1[j * 2] = name[i * 13 + j];
-        long_file_name[i].filename1[j * 2 + 1] = 0;
-      } else {
-        long_file_name[i].filename1[j * 2] = 0;
-        long_file_name[i].filename1[j * 2 + 1] = 0;
-        last = 1;
-      } 
-    }
-    for (j = 5; j < 11; j++) {
-      if (last) {
-        long_file_name[i].filename2[(j - 5) * 2] = 0xFF;
-        long_file_name[i].filename2[(j - 5) * 2 + 1] = 0xFF;
-      } else if (name[j] != '\0') {
-        long_file_name[i].filename2[(j - 5) * 2] = name[i * 13 + j];
-        long_file_name[i].filename2[(j - 5) * 2 + 1] = 0;
+// Returns the cached copy of the aligned block at offset, reading it if
+// needed. Caller holds cache_lock.
+static uint8_t * direct_block(off_t offset) {
+  int i = (offset / DIRECT_ALIGN) % DIRECT_CACHE_BLOCKS;
+  uint8_t *block = direct.blocks + (size_t) i * DIRECT_ALIGN;
+  if (direct.tags[i] != offset) {
+    ssize_t n = pread(direct.fd, block, DIRECT_ALIGN, offset);
+    if (n < DIRECT_ALIGN)
+      memset(block + (n > 0 ? n : 0), 0, DIRECT_ALIGN - (n > 0 ? n : 0));
+    direct.tags[i] = offset;
+  }
+  return block;
+}
+
+// Keeps the cached blocks of [offset, offset + count) in line with buf after a
+// direct write. Caller holds cache_lock.
+static void direct_update_cache(const uint8_t *buf, size_t count, off_t offset) {
+  off_t o;
+  for (o = offset; o < offset + (off_t) count; o += DIRECT_ALIGN) {
+    int i = (o / DIRECT_ALIGN) % DIRECT_CACHE_BLOCKS;
+    if (direct.tags[i] == o)
+      memcpy(direct.blocks + (size_t) i * DIRECT_ALIGN, buf + (o - offset), DIRECT_ALIGN);
+  }
+}
+
+static ssize_t direct_read(void *buf, size_t count, off_t offset) {
+  uint8_t *p = buf;
+  ssize_t total = 0;
+
+  while (count > 0) {
+    size_t n;
+    off_t head = offset % DIRECT_ALIGN;
+    if (head != 0 || count < DIRECT_ALIGN) {
+      n = DIRECT_ALIGN - head < count ? DIRECT_ALIGN - head : count;
+      pthread_mutex_lock(&direct.cache_lock);
+      memcpy(p, direct_block(offset - head) + head, n);
+      pthread_mutex_unlock(&direct.cache_lock);
+    } else {
+      ssize_t r;
+      n = count - count % DIRECT_ALIGN;
+      if ((uintptr_t) p % DIRECT_ALIGN == 0) {
+        r = pread(direct.fd, p, n, offset);
       } else {
-        long_file_name[i].filename2[(j - 5) * 2] = 0;
-        long_file_name[i].filename2[(j - 5) * 2 + 1] = 0;
-        last = 1;
+        uint8_t *buffer = direct_get_buffer();
+        if (n > DIRECT_POOL_SIZE)
+          n = DIRECT_POOL_SIZE;
+        r = pread(direct.fd, buffer, n, offset);
+        if (r > 0)
+          memcpy(p, buffer, r);
+        direct_put_buffer(buffer);
       }
+      if (r <= 0)
+        return total > 0 ? total : r;
+      n = r;
     }
+    p += n;
+    offset += n;
+    count -= n;
+    total += n;
+  }
+  return total;
+}
 
-    if (last) {
-      long_file_name[i].filename3[0] = 0xFF;
-      long_file_name[i].filename3[1] = 0xFF;
-    } else if (name[11] != '\0') {
-      long_file_name[i].filename3[0] = name[i * 13 + 11];
-      long_file_name[i].filename3[1] = 0;
+// Every write holds cache_lock : a read-modify-write of a block must not
+// interleave with a direct write to it (a cluster smaller than a block
+// shares it with its neighbours), or it would write the old data back.
+static ssize_t direct_write(const void *buf, size_t count, off_t offset) {
+  const uint8_t *p = buf;
+  ssize_t total = 0;
+
+  while (count > 0) {
+    size_t n;
+    ssize_t w;
+    off_t head = offset % DIRECT_ALIGN;
+    if (head != 0 || count < DIRECT_ALIGN) {
+      // Read-modify-write of one block, the last one may be partial.
+      n = DIRECT_ALIGN - head < count ? DIRECT_ALIGN - head : count;
+      off_t start = offset - head;
+      // The device does not grow : there is no block to modify past its end.
+      if (start >= direct.size)
+        return total > 0 ? total : -ENOSPC;
+      size_t len = direct.size - start < DIRECT_ALIGN ? direct.size - start : DIRECT_ALIGN;
+      pthread_mutex_lock(&direct.cache_lock);
+      uint8_t *block = direct_block(start);
+      memcpy(block + head, p, n);
+      w = pwrite(direct.fd, block, len, start);
+      pthread_mutex_unlock(&direct.cache_lock);
+      if (w > 0 && (size_t) w < head + n)
+        w = 0;
     } else {
-      long_file_name[i].filename3[0] = 0;
-      long_file_name[i].filename3[1] = 0;
-      last = 1;
+      n = count - count % DIRECT_ALIGN;
+      uint8_t *buffer = NULL;
+      if ((uintptr_t) p % DIRECT_ALIGN != 0) {
+        buffer = direct_get_buffer();
+        if (n > DIRECT_POOL_SIZE)
+          n = DIRECT_POOL_SIZE;
+        memcpy(buffer, p, n);
+      }
+      pthread_mutex_lock(&direct.cache_lock);
+      w = pwrite(direct.fd, buffer ? buffer : p, n, offset);
+      if (w > 0)
+        direct_update_cache(p, w - w % DIRECT_ALIGN, offset);
+      pthread_mutex_unlock(&direct.cache_lock);
+      if (buffer)
+        direct_put_buffer(buffer);
+      if (w > 0)
+        n = w;
     }
+    if (w <= 0)
+      return total > 0 ? total : w;
+    p += n;
+    offset += n;
+    count -= n;
+    total += n;
+  }
+  return total;
+}
 
-    if (last) {
-      long_file_name[i].filename3[0] = 0xFF;
-      long_file_name[i].filename3[1] = 0xFF;
-    } else if (name[12] != '\0') {
-      long_file_name[i].filename3[0] = name[i * 13 + 12];
-      long_file_name[i].filename3[1] = 0;
+// Vectored I/O goes through pool buffers, a chunk at a time : the iovecs of
+// a request are contiguous on the device, so small clusters become one
+// aligned transfer instead of a read-modify-write each. Data sits at the
+// same offset within the buffer as on the device, so that only the first
+// and last blocks of the chunk go through the block cache.
+static ssize_t direct_vector_io(const struct iovec *iov, int iovcnt, off_t offset, int write) {
+  if (iovcnt == 1)
+    return write ? direct_write(iov[0].iov_base, iov[0].iov_len, offset) : direct_read(iov[0].iov_base, iov[0].iov_len, offset);
+
+  uint8_t *buffer = direct_get_buffer();
+  size_t count = 0, done = 0, in = 0;
+  ssize_t error = 0;
+  int i;
+  for (i = 0; i < iovcnt; i++)
+    count += iov[i].iov_len;
+
+  i = 0;
+  while (done < count) {
+    size_t head = (offset + done) % DIRECT_ALIGN;
+    size_t n = count - done < DIRECT_POOL_SIZE - head ? count - done : DIRECT_POOL_SIZE - head;
+    size_t copied = 0, j = i, at = in;
+    ssize_t r;
+
+    if (write) {
+      for (; copied < n; j++, at = 0) {
+        size_t len = iov[j].iov_len - at < n - copied ? iov[j].iov_len - at : n - copied;
+        memcpy(buffer + head + copied, (uint8_t*) iov[j].iov_base + at, len);
+        copied += len;
+        at += len;
+        if (at < iov[j].iov_len)
+          break;
+      }
+      r = direct_write(buffer + head, n, offset + done);
     } else {
-      long_file_name[i].filename3[0] = 0;
-      long_file_name[i].filename3[1] = 0;
-      last = 1;
+      r = direct_read(buffer + head, n, offset + done);
+    }
+    if (r <= 0) {
+      error = r;
+      break;
+    }
+
+    // Moves on, the read data goes out to the iovecs.
+    size_t moved = 0;
+    while (moved < (size_t) r) {
+      size_t len = iov[i].iov_len - in < (size_t) r - moved ? iov[i].iov_len - in : (size_t) r - moved;
+      if (!write)
+        memcpy((uint8_t*) iov[i].iov_base + in, buffer + head + moved, len);
+      moved += len;
+      in += len;
+      if (in == iov[i].iov_len) {
+        i++;
+        in = 0;
+      }
     }
+    done += r;
+    if ((size_t) r < n)
+      break;
   }
+  direct_put_buffer(buffer);
+  return done > 0 ? (ssize_t) done : error;
 }
 
-static int last_cluster() {
-  if (fat_info.fat_type == FAT12) {
-    return 0xFFF;
-  } else if (fat_info.fat_type == FAT16) {
-    return 0xFFFF;
-  } else {
-    return 0x0FFFFFFF;
-  }
+static ssize_t direct_readv(const struct iovec *iov, int iovcnt, off_t offset) {
+  return direct_vector_io(iov, iovcnt, offset, 0);
 }
 
-static int is_free_cluster(int cluster) {
-  return cluster == 0;
+static ssize_t direct_writev(const struct iovec *iov, int iovcnt, off_t offset) {
+  return direct_vector_io(iov, iovcnt, offset, 1);
 }
 
-static int is_last_cluster(int cluster) {
-  if (fat_info.fat_type == FAT12) {
-    return cluster >= 0xFF8 && cluster <= 0xFFF;
-  } else if (fat_info.fat_type == FAT16) {
-    return cluster >= 0xFFF8 && cluster <= 0xFFFF;
-  } else {
-    return cluster >= 0x0FFFFFF8 && cluster <= 0x0FFFFFFF;
-  }
+static int direct_flush() {
+  return fdatasync(direct.fd);
 }
 
-static int is_used_cluster(int cluster) {
-  if (fat_info.fat_type == FAT12) {
-    return cluster >= 0x002 && cluster <= 0xFEF;
-  } else if (fat_info.fat_type == FAT16) {
-    return cluster >= 0x0002 && cluster <= 0xFFEF;
-  } else {
-    return cluster >= 0x00000002 && cluster <= 0x0FFFFFEF;
-  }
+static off_t direct_size() {
+  return lseek(direct.fd, 0, SEEK_END);
 }
 
-static void convert_time_t_to_datetime_fat(time_t time, fat_time_t *timefat, fat_date_t *datefat) {
-  #define MINUTES 60
-  #define HOURS 3600
-  #define DAYS 86400
+static void direct_close() {
+  int i;
+  close(direct.fd);
+  direct.fd = -1;
+  for (i = 0; i < direct.pool_free; i++)
+    free(direct.pool[i]);
+  direct.pool_free = 0;
+  free(direct.blocks);
+}
 
-  int days_per_month[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
-  int days_per_month_leap[] = {31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+static block_backend_t direct_backend = {
+  "direct", direct_open, direct_read, direct_write, direct_readv, direct_writev, direct_flush, direct_size, direct_close
+};
 
-  int year = 1970;
-  int month = 0;
-  int day = 0;
-  int hours = 0;
-  int min = 0;
-  int sec = 0;
+static block_backend_t *device = &file_backend;
+
+// Metadata intent log. Every metadata write (FAT, directories, FSInfo) goes
+// through write_data. With -o journal, the writes of one operation are
+// gathered in a thread local transaction, appended to the sidecar file when
+// the operation ends, and acknowledged. A flusher thread then syncs the log
+// and applies the transactions to the device in large batches, sorted by
+// offset. Until then, read_data overlays them on what the device returns.
+// At mount, committed transactions left in the log are replayed.
+
+#define JOURNAL_BATCH_BYTES (4 << 20)
+#define JOURNAL_INTERVAL_MS 1000
+
+typedef struct _journal_tx {
+  uint8_t *buf;            // records, in log format
+  size_t len;
+  struct _journal_tx *next;
+} journal_tx_t;
+
+// A transaction holding FAT stamps, not committed yet.
+typedef struct _open_stamp {
+  uint64_t stamp;          // its first one, 0 if none
+  struct _open_stamp *next;
+} open_stamp_t;
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_cond_t applied;
+  int fd;                  // sidecar file, -1 when disabled
+  int running;
+  pthread_t thread;
+  journal_tx_t *pending;   // committed, not applied yet
+  journal_tx_t **pending_tail;
+  size_t pending_bytes;
+  journal_tx_t *applying;  // being written to the device
+  journal_tx_t *deferred;  // FAT writes held back for the next batch
+  open_stamp_t *open;      // open transactions holding FAT stamps
+  uint64_t committed;      // number of transactions committed
+  uint64_t done;           // number of transactions applied
+  uint64_t batches;        // number of batches written to the device
+  uint8_t *clusters;       // data clusters written through the log since it was emptied
+} journal = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, -1, 0 };
+
+static __thread struct {
+  int depth;
+  uint8_t *buf;
+  size_t len;
+  size_t size;
+  open_stamp_t open;
+} tx;
+
+// Stamps of the JOURNAL_FAT_WRITE records (journal.lock).
+static uint64_t fat_write_stamp;
+
+// The bytes a write record puts on the device.
+static const uint8_t * record_data(const journal_record_t *record, uint32_t *length) {
+  const uint8_t *data = (const uint8_t*)(record + 1);
+  if (record->type == JOURNAL_FAT_WRITE) {
+    *length = record->length - sizeof(uint64_t);
+    return data + sizeof(uint64_t);
+  }
+  *length = record->length;
+  return data;
+}
 
-  int secs_year = DAYS * 365;
-  int *dpm = days_per_month;
+static uint32_t journal_checksum(const journal_record_t *record, const uint8_t *data) {
+  journal_record_t header = *record;
+  uint32_t h = 2166136261u;
+  size_t i;
+  header.checksum = 0;
+  for (i = 0; i < sizeof(header); i++)
+    h = (h ^ ((uint8_t*)&header)[i]) * 16777619u;
+  for (i = 0; i < record->length; i++)
+    h = (h ^ data[i]) * 16777619u;
+  return h;
+}
 
-  while (time) {
-    if (time >= secs_year) {
-      year++;
-      time -= secs_year;
+static void tx_append(uint32_t type, const void *data, uint32_t length, off_t offset) {
+  journal_record_t record = { JOURNAL_MAGIC, type, offset, length, 0 };
+  record.checksum = journal_checksum(&record, data);
 
-      if (!(year % 400 && (year % 100 == 0 || (year & 3)))) {
-        secs_year = DAYS * 366;
-        dpm = days_per_month_leap;
-      } else {
-        secs_year = DAYS * 365;
-        dpm = days_per_month;
-      }
-    } else {
-      if (time >= dpm[month] * DAYS) {
-        time -= dpm[month] * DAYS;
-        month++;
-      } else {
-        day = time / DAYS;
-        time -= day * DAYS;
-        hours = time / HOURS;
-        time -= hours * HOURS;
-        min = time / MINUTES;
-        time -= min * MINUTES;
-        sec = time;
-        time = 0;
-      }
-    }
+  if (tx.len + sizeof(record) + length > tx.size) {
+    tx.size = (tx.len + sizeof(record) + length) * 2;
+    tx.buf = realloc(tx.buf, tx.size);
   }
+  memcpy(tx.buf + tx.len, &record, sizeof(record));
+  memcpy(tx.buf + tx.len + sizeof(record), data, length);
+  tx.len += sizeof(record) + length;
+}
 
-  datefat->year = year - 1980;
-  datefat->month = month + 1;
-  datefat->day = day + 1;
-  if (timefat) {
-    timefat->hours = hours;
-    timefat->minutes = min;
-    timefat->seconds2 = sec / 2;
+// Copies the records of a transaction list that overlap [offset, offset + count) over buf.
+static void journal_overlay(journal_tx_t *t, uint8_t *buf, size_t count, off_t offset) {
+  for (; t; t = t->next) {
+    size_t p = 0;
+    while (p < t->len) {
+      journal_record_t *record = (journal_record_t*)(t->buf + p);
+      uint32_t length;
+      const uint8_t *data = record_data(record, &length);
+      off_t start = record->offset > (uint64_t) offset ? (off_t) record->offset : offset;
+      off_t end = record->offset + length < (uint64_t)(offset + count) ? (off_t)(record->offset + length) : offset + (off_t) count;
+      if ((record->type == JOURNAL_WRITE || record->type == JOURNAL_FAT_WRITE) && start < end)
+        memcpy(buf + (start - offset), data + (start - record->offset), end - start);
+      p += sizeof(journal_record_t) + record->length;
+    }
   }
 }
 
-static time_t convert_datetime_fat_to_time_t(fat_date_t *date, fat_time_t *time) {
-  int seconds, minutes, hours;
+static void tx_begin() {
+  tx.depth++;
+}
 
-  if (time) {
-    seconds = time->seconds2 * 2;
-    minutes = time->minutes;
-    hours = time->hours;
-  } else {
-    seconds = minutes = hours = 0;
+// Marks the data clusters the writes of t go to (journal.lock held).
+static void journal_mark_clusters(journal_tx_t *t) {
+  uint32_t cluster_size = fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector;
+  size_t p = 0;
+
+  while (p < t->len) {
+    journal_record_t *record = (journal_record_t*)(t->buf + p);
+    if (record->type == JOURNAL_WRITE && record->offset >= (uint64_t) fat_info.addr_data && record->length > 0) {
+      uint64_t c = (record->offset - fat_info.addr_data) / cluster_size + 2;
+      uint64_t last = (record->offset + record->length - 1 - fat_info.addr_data) / cluster_size + 2;
+      for (; c <= last && c < fat_info.total_data_clusters + 2; c++)
+        journal.clusters[c / 8] |= 1 << (c % 8);
+    }
+    p += sizeof(journal_record_t) + record->length;
   }
+}
 
-  struct tm t = {
-    .tm_sec = seconds,
-    .tm_min = minutes,
-    .tm_hour = hours,
-    .tm_mday = date->day,
-    .tm_mon = date->month - 1,
-    .tm_year = date->year + 80,
-  };
+// Returns -EIO if the transaction could not be logged. It is applied all the
+// same, as the table in memory already has it, but is not crash safe.
+static int tx_commit() {
+  if (--tx.depth > 0 || tx.len == 0)
+    return 0;
 
-  return mktime(&t);
+  tx_append(JOURNAL_COMMIT, NULL, 0, 0);
+  journal_tx_t *t = malloc(sizeof(journal_tx_t));
+  t->buf = tx.buf;
+  t->len = tx.len;
+  t->next = NULL;
+  tx.buf = NULL;
+  tx.len = tx.size = 0;
+
+  pthread_mutex_lock(&journal.lock);
+  if (tx.open.stamp) {
+    open_stamp_t **o = &journal.open;
+    while (*o != &tx.open)
+      o = &(*o)->next;
+    *o = tx.open.next;
+    tx.open.stamp = 0;
+  }
+  int ret = 0;
+  off_t end = lseek(journal.fd, 0, SEEK_CUR);
+  if (write(journal.fd, t->buf, t->len) != (ssize_t) t->len) {
+    // Drop the torn record, replay would stop at it anyway.
+    if (end >= 0 && ftruncate(journal.fd, end) == 0)
+      lseek(journal.fd, end, SEEK_SET);
+    ret = -EIO;
+  }
+  journal_mark_clusters(t);
+  *journal.pending_tail = t;
+  journal.pending_tail = &t->next;
+  journal.pending_bytes += t->len;
+  journal.committed++;
+  if (journal.pending_bytes >= JOURNAL_BATCH_BYTES)
+    pthread_cond_signal(&journal.cond);
+  pthread_mutex_unlock(&journal.lock);
+  return ret;
 }
 
-static void read_fat() {
-  uint8_t buffer[fat_info.BS.bytes_per_sector * fat_info.table_size];
-  
-  uint32_t i;
-  int p = 0;
-  uint32_t tmp = 0;
+static void write_data(void * buf, size_t count, off_t offset) {
+  if (journal.running) {
+    tx_begin();
+    tx_append(JOURNAL_WRITE, buf, count, offset);
+    tx_commit();
+    return;
+  }
+  device->write(buf, count, offset);
+}
 
-  read_data(buffer, sizeof(buffer), fat_info.addr_fat[0]);
+// Writes to the FAT copies, made with the locks of the groups they cover
+// held : the stamp then orders them as the table changed. Until the
+// transaction commits, it is listed as open with its first stamp.
+static void write_fat_data(void * buf, size_t count, off_t offset) {
+  if (journal.running) {
+    uint8_t *stamped = malloc(sizeof(uint64_t) + count);
+    pthread_mutex_lock(&journal.lock);
+    uint64_t stamp = ++fat_write_stamp;
+    if (tx.open.stamp == 0) {
+      tx.open.stamp = stamp;
+      tx.open.next = journal.open;
+      journal.open = &tx.open;
+    }
+    pthread_mutex_unlock(&journal.lock);
+    memcpy(stamped, &stamp, sizeof(uint64_t));
+    memcpy(stamped + sizeof(uint64_t), buf, count);
+    tx_begin();
+    tx_append(JOURNAL_FAT_WRITE, stamped, sizeof(uint64_t) + count, offset);
+    tx_commit();
+    free(stamped);
+    return;
+  }
+  device->write(buf, count, offset);
+}
 
-  if (fat_info.fat_type == FAT12) {
-    // decodage FAT12
-    for (i = 0; i < fat_info.total_data_clusters; i += 2) {
-      tmp = buffer[p] + (buffer[p + 1] << 8) + (buffer[p + 2] << 16);
+static void read_data(void * buf, size_t count, off_t offset) {
+  uint64_t batches = journal.batches;
+  device->read(buf, count, offset);
+
+  if (journal.running) {
+    pthread_mutex_lock(&journal.lock);
+    // A batch landed while reading : the device may hold a mix, read again.
+    while (journal.batches != batches) {
+      batches = journal.batches;
+      pthread_mutex_unlock(&journal.lock);
+      device->read(buf, count, offset);
+      pthread_mutex_lock(&journal.lock);
+    }
+    journal_overlay(journal.deferred, buf, count, offset);
+    journal_overlay(journal.applying, buf, count, offset);
+    journal_overlay(journal.pending, buf, count, offset);
+    pthread_mutex_unlock(&journal.lock);
+    if (tx.len) {
+      journal_tx_t own = { tx.buf, tx.len, NULL };
+      journal_overlay(&own, buf, count, offset);
+    }
+  }
+}
+
+typedef struct _journal_write {
+  uint64_t offset;
+  uint32_t length;
+  uint64_t seq;
+  const uint8_t *data;
+} journal_write_t;
+
+static int journal_write_by_offset(const void *a, const void *b) {
+  const journal_write_t *wa = a, *wb = b;
+  if (wa->offset != wb->offset)
+    return wa->offset < wb->offset ? -1 : 1;
+  return wa->seq < wb->seq ? -1 : wa->seq > wb->seq;
+}
 
-      // on extrait les 2 clusters de 12bits
-      fat_info.file_alloc_table[i] = (tmp & 0xFFF); // 12 least significant bits
-      fat_info.file_alloc_table[i + 1] = (tmp >> 12); // 12 most significant bits
+static int journal_write_by_seq(const void *a, const void *b) {
+  const journal_write_t *wa = a, *wb = b;
+  return wa->seq < wb->seq ? -1 : wa->seq > wb->seq;
+}
 
-      p += 3;
+// Applies the writes of a list of transactions : sorted by offset, merged
+// into runs of overlapping or adjacent writes, each run written once with the
+// writes applied in log order.
+// Transactions of different threads may log the same FAT sector, and commit
+// in another order than they encoded it. FAT writes are therefore ordered by
+// their stamps, and those from limit on are held back : a transaction still
+// open may hold a lower stamp on the same bytes, which would land after
+// them. They are returned as one transaction, to go with the next batch.
+static journal_tx_t * journal_apply(journal_tx_t *list, uint64_t limit) {
+  journal_write_t *writes = NULL, *revokes = NULL;
+  size_t n = 0, size = 0, n_revokes = 0, i, k;
+  journal_tx_t *t, *held = NULL;
+
+  for (t = list; t; t = t->next) {
+    size_t p = 0;
+    while (p < t->len) {
+      journal_record_t *record = (journal_record_t*)(t->buf + p);
+      size_t record_size = sizeof(journal_record_t) + record->length;
+      uint64_t stamp;
+      if (record->type == JOURNAL_FAT_WRITE) {
+        memcpy(&stamp, t->buf + p + sizeof(journal_record_t), sizeof(uint64_t));
+        if (stamp >= limit) {
+          if (held == NULL)
+            held = calloc(1, sizeof(journal_tx_t));
+          held->buf = realloc(held->buf, held->len + record_size);
+          memcpy(held->buf + held->len, record, record_size);
+          held->len += record_size;
+          p += record_size;
+          continue;
+        }
+      }
+      if (record->type == JOURNAL_REVOKE) {
+        uint64_t length;
+        memcpy(&length, t->buf + p + sizeof(journal_record_t), sizeof(uint64_t));
+        revokes = realloc(revokes, sizeof(journal_write_t) * (n_revokes + 1));
+        revokes[n_revokes].offset = record->offset;
+        revokes[n_revokes].length = length;
+        revokes[n_revokes].seq = n;
+        n_revokes++;
+      }
+      if (record->type == JOURNAL_WRITE || record->type == JOURNAL_FAT_WRITE) {
+        if (n == size) {
+          size = size ? size * 2 : 256;
+          writes = realloc(writes, sizeof(journal_write_t) * size);
+        }
+        writes[n].offset = record->offset;
+        writes[n].data = record_data(record, &writes[n].length);
+        // FAT writes only overlap FAT writes : their stamps order them.
+        writes[n].seq = record->type == JOURNAL_FAT_WRITE ? stamp : n;
+        n++;
+      }
+      p += record_size;
     }
-  } else if (fat_info.fat_type == FAT16) {
-    for (i = 0; i < fat_info.total_data_clusters; i++) {
-      fat_info.file_alloc_table[i] = buffer[i * 2] + (buffer[i * 2 + 1] << 8);
+  }
+
+  // Cut what a later revoke covers out of the writes, the part past it goes
+  // to the end of the array and is cut in turn.
+  for (i = 0; i < n; i++) {
+    for (k = 0; k < n_revokes && writes[i].length > 0; k++) {
+      uint64_t from = revokes[k].offset, to = from + revokes[k].length;
+      uint64_t start = writes[i].offset, end = start + writes[i].length;
+      if (revokes[k].seq <= writes[i].seq || to <= start || end <= from)
+        continue;
+      if (end > to) {
+        if (n == size) {
+          size *= 2;
+          writes = realloc(writes, sizeof(journal_write_t) * size);
+        }
+        writes[n] = writes[i];
+        writes[n].offset = to;
+        writes[n].length = end - to;
+        writes[n].data += to - start;
+        n++;
+      }
+      if (start < from) {
+        writes[i].length = from - start;
+      } else {
+        writes[i].length = 0;
+      }
     }
-  } else if (fat_info.fat_type == FAT32) {
-    for (i = 0; i < fat_info.total_data_clusters; i++) {
-      fat_info.file_alloc_table[i] = buffer[i * 4] + (buffer[i * 4 + 1] << 8) + (buffer[i * 4 + 2] << 16) + (buffer[i * 4 + 3] << 24);
+  }
+  for (i = k = 0; i < n; i++) {
+    if (writes[i].length > 0)
+      writes[k++] = writes[i];
+  }
+  n = k;
+  free(revokes);
+  qsort(writes, n, sizeof(journal_write_t), journal_write_by_offset);
+
+  i = 0;
+  while (i < n) {
+    uint64_t start = writes[i].offset, end = start + writes[i].length;
+    size_t j = i + 1;
+    while (j < n && writes[j].offset <= end) {
+      if (writes[j].offset + writes[j].length > end)
+        end = writes[j].offset + writes[j].length;
+      j++;
     }
+    qsort(writes + i, j - i, sizeof(journal_write_t), journal_write_by_seq);
+    uint8_t *run = malloc(end - start);
+    for (k = i; k < j; k++)
+      memcpy(run + (writes[k].offset - start), writes[k].data, writes[k].length);
+    device->write(run, end - start, start);
+    free(run);
+    i = j;
   }
+  free(writes);
+  return held;
 }
 
-static void write_fat() {
-  uint8_t buffer[fat_info.BS.bytes_per_sector * fat_info.table_size];
-  
-  uint32_t i;
-  int p = 0;
-  uint32_t tmp = 0;
+static void journal_free(journal_tx_t *list) {
+  while (list) {
+    journal_tx_t *next = list->next;
+    free(list->buf);
+    free(list);
+    list = next;
+  }
+}
 
-  if (fat_info.fat_type == FAT12) {
-    for (i = 0; i < fat_info.total_data_clusters; i += 2) {
-      tmp = (fat_info.file_alloc_table[i + 1] << 12) + (fat_info.file_alloc_table[i] & 0xFFF);
-      buffer[p++] = tmp & 0x0000FF;
-      buffer[p++] = tmp & 0x00FF00;
-      buffer[p++] = tmp & 0xFF0000;
+// Moves everything committed so far to the device. If the flusher is at it,
+// waits for its batch and then flushes what was committed meanwhile.
+static void journal_flush() {
+  pthread_mutex_lock(&journal.lock);
+  uint64_t upto = journal.committed;
+  for (;;) {
+    if (journal.applying) {
+      pthread_cond_wait(&journal.applied, &journal.lock);
+      continue;
     }
-  } else if (fat_info.fat_type == FAT16) {
-    for (i = 0; i < fat_info.total_data_clusters; i++) {
-      buffer[i*2] = fat_info.file_alloc_table[i] & 0x00FF;
-      buffer[i*2 + 1] = fat_info.file_alloc_table[i] & 0xFF00;
+    // Held back FAT writes can go once no transaction is open.
+    if (journal.done >= upto && (journal.deferred == NULL || journal.open != NULL))
+      break;
+
+    journal_tx_t *list = journal.deferred, **tail = &list;
+    while (*tail)
+      tail = &(*tail)->next;
+    *tail = journal.pending;
+    uint64_t batch = journal.committed, limit = UINT64_MAX;
+    open_stamp_t *o;
+    for (o = journal.open; o; o = o->next) {
+      if (o->stamp < limit)
+        limit = o->stamp;
     }
-  } else if (fat_info.fat_type == FAT32) {
-    for (i = 0; i < fat_info.total_data_clusters; i++) {
-      buffer[i*4]     = fat_info.file_alloc_table[i] & 0x000000FF;
-      buffer[i*4 + 1] = fat_info.file_alloc_table[i] & 0x0000FF00;
-      buffer[i*4 + 2] = fat_info.file_alloc_table[i] & 0x00FF0000;
-      buffer[i*4 + 3] = fat_info.file_alloc_table[i] & 0xFF000000;
+    journal.applying = list;
+    journal.deferred = NULL;
+    journal.pending = NULL;
+    journal.pending_tail = &journal.pending;
+    journal.pending_bytes = 0;
+    pthread_mutex_unlock(&journal.lock);
+
+    // The intents must be durable before the device is touched.
+    fdatasync(journal.fd);
+    journal_tx_t *held = journal_apply(list, limit);
+    device->flush();
+
+    pthread_mutex_lock(&journal.lock);
+    journal.applying = NULL;
+    journal.deferred = held;
+    journal.done = batch;
+    journal.batches++;
+    // Replaying applied transactions is harmless, only truncate when no newer
+    // one was logged and nothing was held back.
+    if (journal.pending == NULL && journal.deferred == NULL && ftruncate(journal.fd, 0) == 0) {
+      lseek(journal.fd, 0, SEEK_SET);
+      memset(journal.clusters, 0, (fat_info.total_data_clusters + 2 + 7) / 8);
     }
+    pthread_cond_broadcast(&journal.applied);
+    pthread_mutex_unlock(&journal.lock);
+    journal_free(list);
+    pthread_mutex_lock(&journal.lock);
   }
- 
-  for (i = 0; i < fat_info.BS.table_count; i++) {
-    write_data(buffer, sizeof(buffer), fat_info.addr_fat[i]);
+  pthread_mutex_unlock(&journal.lock);
+}
+
+static void * journal_thread(void *arg) {
+  pthread_mutex_lock(&journal.lock);
+  while (journal.running) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += (JOURNAL_INTERVAL_MS % 1000) * 1000000L;
+    ts.tv_sec += JOURNAL_INTERVAL_MS / 1000 + ts.tv_nsec / 1000000000L;
+    ts.tv_nsec %= 1000000000L;
+    if (journal.pending_bytes < JOURNAL_BATCH_BYTES)
+      pthread_cond_timedwait(&journal.cond, &journal.lock, &ts);
+    pthread_mutex_unlock(&journal.lock);
+    journal_flush();
+    pthread_mutex_lock(&journal.lock);
   }
+  pthread_mutex_unlock(&journal.lock);
+  return NULL;
 }
 
-static void write_fat_entry(int index) {
-	int i;
-	if (fat_info.fat_type == FAT12) {
-		uint32_t tmp;
-		char buffer[3]; // 24 bits : 2 entries
-		if (index % 2 == 0) {
-      tmp = (fat_info.file_alloc_table[index + 1] << 12) + (fat_info.file_alloc_table[index] & 0xFFF);
-		} else {
-      tmp = (fat_info.file_alloc_table[index] << 12) + (fat_info.file_alloc_table[index - 1] & 0xFFF);
-		}
-    buffer[0] = tmp & 0x0000FF;
-    buffer[1] = tmp & 0x00FF00;
-    buffer[2] = tmp & 0xFF0000;
+// Replays the committed transactions of the sidecar file, stopping at the
+// first torn or incomplete one.
+static void replay_journal() {
+  if (options.journal == NULL)
+    return;
+  // Nothing may be written to a read-only mount, not even what was logged.
+  if (options.readonly) {
+    fprintf(stderr, "Read-only mount : journal %s not replayed\n", options.journal);
+    return;
+  }
+  journal.fd = open(options.journal, O_RDWR | O_CREAT, 0600);
+  if (journal.fd < 0) {
+    fprintf(stderr, "Cannot open journal %s\n", options.journal);
+    return;
+  }
 
-		for (i = 0; i < fat_info.BS.table_count; i++) {
-			write_data(buffer, sizeof(buffer), fat_info.addr_fat[i] + index * 12);
-		}
-  } else if (fat_info.fat_type == FAT16) {
-		char buffer[2];
-    buffer[0] = fat_info.file_alloc_table[index] & 0x00FF;
-    buffer[1] = fat_info.file_alloc_table[index] & 0xFF00;
-		for (i = 0; i < fat_info.BS.table_count; i++) {
-			write_data(buffer, sizeof(buffer), fat_info.addr_fat[i] + index * 16);
-		}
-  } else if (fat_info.fat_type == FAT32) {
-		char buffer[4];
-    buffer[0] = fat_info.file_alloc_table[index] & 0x000000FF;
-    buffer[1] = fat_info.file_alloc_table[index] & 0x0000FF00;
-    buffer[2] = fat_info.file_alloc_table[index] & 0x00FF0000;
-    buffer[3] = fat_info.file_alloc_table[index] & 0xFF000000;
-		for (i = 0; i < fat_info.BS.table_count; i++) {
-			write_data(buffer, sizeof(buffer), fat_info.addr_fat[i] + index * 32);
-		}
+  off_t size = lseek(journal.fd, 0, SEEK_END);
+  uint8_t *log = malloc(size > 0 ? size : 1);
+  pread(journal.fd, log, size, 0);
+
+  journal_tx_t *list = NULL, **tail = &list;
+  off_t p = 0, tx_start = 0;
+  int n = 0;
+  while (p + (off_t) sizeof(journal_record_t) <= size) {
+    journal_record_t *record = (journal_record_t*)(log + p);
+    if (record->magic != JOURNAL_MAGIC || p + (off_t) sizeof(journal_record_t) + record->length > size ||
+        journal_checksum(record, log + p + sizeof(journal_record_t)) != record->checksum)
+      break;
+    p += sizeof(journal_record_t) + record->length;
+    if (record->type == JOURNAL_COMMIT) {
+      journal_tx_t *t = malloc(sizeof(journal_tx_t));
+      t->len = p - tx_start;
+      t->buf = malloc(t->len);
+      memcpy(t->buf, log + tx_start, t->len);
+      t->next = NULL;
+      *tail = t;
+      tail = &t->next;
+      tx_start = p;
+      n++;
+    }
   }
- 
+  free(log);
+
+  if (n > 0) {
+    fprintf(stderr, "Replaying %d transactions from %s\n", n, options.journal);
+    journal_apply(list, UINT64_MAX);
+    device->flush();
+    journal_free(list);
+  }
+  if (ftruncate(journal.fd, 0) == 0)
+    lseek(journal.fd, 0, SEEK_SET);
 }
 
-static void mount_fat() {
-  fprintf(stderr, "Mount FAT.\n");
-  int fd = open(options.device, O_RDONLY);
-  if (fd > 0) {
-		pread(fd, &fat_info.BS, sizeof(fat_BS_t), 0);
-    
-    if (fat_info.BS.table_size_16 == 0) { // Si 0 alors on considère qu'on est en FAT32.
-      fat_info.ext_BIOS_16 = NULL;
-      fat_info.ext_BIOS_32 = malloc(sizeof(fat_extended_BIOS_32_t));
-      pread(fd, fat_info.ext_BIOS_32, sizeof(fat_extended_BIOS_32_t), sizeof(fat_BS_t));
-      fat_info.table_size = fat_info.ext_BIOS_32->table_size_32;
+static void start_journal() {
+  if (journal.fd < 0)
+    return;
+  journal.pending = NULL;
+  journal.pending_tail = &journal.pending;
+  journal.clusters = calloc((fat_info.total_data_clusters + 2 + 7) / 8, 1);
+  journal.running = 1;
+  if (pthread_create(&journal.thread, NULL, journal_thread, NULL) != 0)
+    journal.running = 0;
+}
+
+static void stop_journal() {
+  if (!journal.running)
+    return;
+  pthread_mutex_lock(&journal.lock);
+  journal.running = 0;
+  pthread_cond_signal(&journal.cond);
+  pthread_mutex_unlock(&journal.lock);
+  pthread_join(journal.thread, NULL);
+  journal_flush();
+  close(journal.fd);
+  journal.fd = -1;
+  free(journal.clusters);
+  journal.clusters = NULL;
+}
+
+// File data is about to go straight to [offset, offset + count) of the data
+// area. Writes the log still holds there, from when the clusters were a
+// directory, are revoked and flushed first : applied or replayed after the
+// data, they would overwrite it.
+static void journal_revoke(off_t offset, size_t count) {
+  uint32_t cluster_size = fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector;
+  uint32_t c = (offset - fat_info.addr_data) / cluster_size + 2;
+  uint32_t last = (offset + count - 1 - fat_info.addr_data) / cluster_size + 2;
+
+  if (!journal.running || count == 0)
+    return;
+  while (c <= last && !(__atomic_load_n(&journal.clusters[c / 8], __ATOMIC_RELAXED) & (1 << (c % 8))))
+    c++;
+  if (c > last)
+    return;
+
+  uint64_t length = count;
+  tx_begin();
+  tx_append(JOURNAL_REVOKE, &length, sizeof(length), offset);
+  tx_commit();
+  journal_flush();
+}
+
+// Builds the 8.3 basis name of filename in sfn (11 characters, space padded,
+// no dot). Returns 1 if the conversion lost information, in which case a
+// numeric tail is needed.
+static int lfn_to_sfn(const char * filename, char * sfn) {
+  char * lfn = strdup(filename);
+  int lossy = 0;
+
+  // To upper case, convert to OEM (=> '_', once per UTF-8 sequence).
+  int i = 0;
+  int j = 0;
+  while (lfn[i] != '\0') {
+    if (((unsigned char)lfn[i] & 0xC0) == 0x80) {
+      i++;
+      continue;
+    }
+    lfn[j] = toupper((unsigned char)lfn[i]);
+    if ((unsigned char)lfn[j] >= 0x80 || strchr("+,;=[]", lfn[j])) {
+      lfn[j] = '_';
+      lossy = 1;
+    }
+    i++;
+    j++;
+  }
+  lfn[j] = '\0';
+
+  // Strip all leading and embedded spaces, and leading periods.
+  j = 0;
+  i = 0;
+  while (lfn[i] == '.') {
+    i++;
+    lossy = 1;
+  }
+  while (lfn[i] != '\0') {
+    if (lfn[i] != ' ') {
+      lfn[j] = lfn[i];
+      j++;
     } else {
-      fat_info.ext_BIOS_32 = NULL;
-      fat_info.ext_BIOS_16 = malloc(sizeof(fat_extended_BIOS_16_t));
-      pread(fd, fat_info.ext_BIOS_16, sizeof(fat_extended_BIOS_16_t), sizeof(fat_BS_t));
-      fat_info.table_size = fat_info.BS.table_size_16;
+      lossy = 1;
     }
-    close(fd);
+    i++;
+  }
+  lfn[j] = '\0';
 
-    fprintf(stderr, "table size : %d\n", fat_info.table_size);
+  memset(sfn, ' ', 11);
 
+  char * ext = strrchr(lfn, '.');
+  if (ext != NULL) {
+    *ext++ = '\0';
+    for (i = 0; ext[i] != '\0'; i++) {
+      if (i < 3)
+        sfn[8 + i] = ext[i];
+      else
+        lossy = 1;
+    }
+  }
 
-    fprintf(stderr, "%d bytes per logical sector\n", fat_info.BS.bytes_per_sector);
-    fprintf(stderr, "%d bytes per clusters\n", fat_info.BS.bytes_per_sector * fat_info.BS.sectors_per_cluster);
- 
-    fat_info.addr_fat = (unsigned int*) malloc(sizeof(unsigned int) * fat_info.BS.table_count);
-    
+  // Copy first 8 caracters, embedded periods are dropped.
+  for (i = 0, j = 0; lfn[i] != '\0'; i++) {
+    if (lfn[i] == '.' || j == 8) {
+      lossy = 1;
+    } else {
+      sfn[j++] = lfn[i];
+    }
+  }
+  if (j == 0) {
+    sfn[j] = '_';
+    lossy = 1;
+  }
+
+	free(lfn);
+  return lossy;
+}
+
+static uint32_t sfn_hash(const char * sfn) {
+  uint32_t h = 2166136261u;
+  int i;
+  for (i = 0; i < 11; i++)
+    h = (h ^ (uint8_t)sfn[i]) * 16777619u;
+  return h;
+}
+
+static int sfn_set_contains(dir_slots_t *slots, const char * sfn) {
+  sfn_node_t *node;
+  if (slots->sfn_n_buckets == 0)
+    return 0;
+  for (node = slots->sfn_buckets[sfn_hash(sfn) & (slots->sfn_n_buckets - 1)]; node; node = node->next) {
+    if (memcmp(node->name, sfn, 11) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+static void sfn_set_add(dir_slots_t *slots, const char * sfn) {
+  if (slots->sfn_count >= slots->sfn_n_buckets) {
+    int n_buckets = slots->sfn_n_buckets ? slots->sfn_n_buckets * 2 : 64;
+    sfn_node_t **buckets = calloc(n_buckets, sizeof(sfn_node_t*));
     int i;
-    for (i = 0; i < fat_info.BS.table_count; i++) {
-      fat_info.addr_fat[i] = (fat_info.BS.reserved_sector_count + i * fat_info.table_size) * fat_info.BS.bytes_per_sector;
+    for (i = 0; i < slots->sfn_n_buckets; i++) {
+      sfn_node_t *node = slots->sfn_buckets[i];
+      while (node) {
+        sfn_node_t *next = node->next;
+        uint32_t b = sfn_hash(node->name) & (n_buckets - 1);
+        node->next = buckets[b];
+        buckets[b] = node;
+        node = next;
+      }
     }
-    fat_info.addr_root_dir = (fat_info.BS.reserved_sector_count + fat_info.BS.table_count * fat_info.table_size) * fat_info.BS.bytes_per_sector;
-    fat_info.addr_data = fat_info.addr_root_dir + (fat_info.BS.root_entry_count * sizeof(fat_dir_entry_t));
-    if (fat_info.BS.total_sectors_16 > 0)
-      fat_info.total_data_clusters = fat_info.BS.total_sectors_16 / fat_info.BS.sectors_per_cluster - fat_info.addr_data / (fat_info.BS.bytes_per_sector * fat_info.BS.sectors_per_cluster);
-    else
-      fat_info.total_data_clusters = fat_info.BS.total_sectors_32 / fat_info.BS.sectors_per_cluster - fat_info.addr_data / (fat_info.BS.bytes_per_sector * fat_info.BS.sectors_per_cluster);
+    free(slots->sfn_buckets);
+    slots->sfn_buckets = buckets;
+    slots->sfn_n_buckets = n_buckets;
+  }
 
-    if (fat_info.total_data_clusters < 4086) {
-      fat_info.fat_type = FAT12;
-      fprintf(stderr, "FAT Type : FAT12\n");
-    } else if (fat_info.total_data_clusters < 65526) {
-      fat_info.fat_type = FAT16;
-      fprintf(stderr, "FAT Type : FAT16\n");
+  sfn_node_t *node = malloc(sizeof(sfn_node_t));
+  memcpy(node->name, sfn, 11);
+  uint32_t b = sfn_hash(sfn) & (slots->sfn_n_buckets - 1);
+  node->next = slots->sfn_buckets[b];
+  slots->sfn_buckets[b] = node;
+  slots->sfn_count++;
+}
+
+static void sfn_set_remove(dir_slots_t *slots, const char * sfn) {
+  if (slots->sfn_n_buckets == 0)
+    return;
+  sfn_node_t **link = &slots->sfn_buckets[sfn_hash(sfn) & (slots->sfn_n_buckets - 1)];
+  while (*link) {
+    sfn_node_t *node = *link;
+    if (memcmp(node->name, sfn, 11) == 0) {
+      *link = node->next;
+      free(node);
+      slots->sfn_count--;
+      return;
+    }
+    link = &node->next;
+  }
+}
+
+static void sfn_set_free(dir_slots_t *slots) {
+  int i;
+  for (i = 0; i < slots->sfn_n_buckets; i++) {
+    sfn_node_t *node = slots->sfn_buckets[i];
+    while (node) {
+      sfn_node_t *next = node->next;
+      free(node);
+      node = next;
+    }
+  }
+  free(slots->sfn_buckets);
+}
+
+// Replaces the end of the basis name with a numeric tail ("~n").
+static void apply_numeric_tail(char * sfn, const char * basis, int prefix, const char * tail) {
+  int len = strlen(tail);
+  while (prefix > 0 && basis[prefix - 1] == ' ')
+    prefix--;
+  if (prefix > 8 - len)
+    prefix = 8 - len;
+  memcpy(sfn, basis, prefix);
+  memcpy(sfn + prefix, tail, len);
+  memset(sfn + prefix + len, ' ', 8 - prefix - len);
+  memcpy(sfn + 8, basis + 8, 3);
+}
+
+// Picks a short name for filename that is unique in the directory. Like
+// Windows, ~1 to ~4 are tried on the basis name, then the name is built from
+// the first two characters and a hash of the long name, so that thousands
+// of names sharing a prefix still cost a handful of set lookups each.
+static void generate_short_name(dir_slots_t *slots, const char * filename, char * sfn) {
+  char basis[11];
+  char tail[8];
+  int n;
+
+  int lossy = lfn_to_sfn(filename, basis);
+  memcpy(sfn, basis, 11);
+  if (!lossy && !sfn_set_contains(slots, sfn))
+    return;
+
+  for (n = 1; n <= 4; n++) {
+    sprintf(tail, "~%d", n);
+    apply_numeric_tail(sfn, basis, 8, tail);
+    if (!sfn_set_contains(slots, sfn))
+      return;
+  }
+
+  uint32_t h = 2166136261u;
+  for (n = 0; filename[n] != '\0'; n++)
+    h = (h ^ (uint8_t)filename[n]) * 16777619u;
+
+  for (;;) {
+    for (n = 1; n <= 9; n++) {
+      sprintf(tail, "%04X~%d", (h ^ (h >> 16)) & 0xFFFF, n);
+      apply_numeric_tail(sfn, basis, 2, tail);
+      if (!sfn_set_contains(slots, sfn))
+        return;
+    }
+    h = h * 16777619u + 1;
+  }
+}
+
+static uint8_t lfn_checksum(const char * sfn) {
+  uint8_t sum = 0;
+  int i;
+  for (i = 0; i < 11; i++)
+    sum = ((sum & 1) << 7) + (sum >> 1) + (uint8_t)sfn[i];
+  return sum;
+}
+
+// Long names are UTF-16 on disk and UTF-8 everywhere else. Names are almost
+// always ASCII : both directions convert 8 (SSE2) code units at a time while
+// that holds and fall back to the general case for the rest.
+
+// Converts up to n code units, stopping at a 0x0000 terminator, into a nul
+// terminated UTF-8 string of at most size bytes. Unpaired surrogates become
+// U+FFFD. Returns the length of the string.
+static int utf16_to_utf8(const uint16_t * src, int n, char * dst, int size) {
+  int i = 0, j = 0;
+
+  while (i < n) {
+#ifdef __SSE2__
+    while (i + 8 <= n && j + 9 <= size) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+      // Any bit above 0x7F, or a zero unit, ends the fast path.
+      __m128i ascii = _mm_cmpeq_epi16(_mm_and_si128(v, _mm_set1_epi16((short) 0xFF80)), _mm_setzero_si128());
+      __m128i zero = _mm_cmpeq_epi16(v, _mm_setzero_si128());
+      if (_mm_movemask_epi8(_mm_andnot_si128(zero, ascii)) != 0xFFFF)
+        break;
+      _mm_storel_epi64((__m128i*)(dst + j), _mm_packus_epi16(v, v));
+      i += 8;
+      j += 8;
+    }
+#endif
+    if (i >= n)
+      break;
+    uint32_t c = src[i++];
+    if (c == 0)
+      break;
+    if (c >= 0xD800 && c <= 0xDBFF && i < n && src[i] >= 0xDC00 && src[i] <= 0xDFFF)
+      c = 0x10000 + ((c - 0xD800) << 10) + (src[i++] - 0xDC00);
+    else if (c >= 0xD800 && c <= 0xDFFF)
+      c = 0xFFFD;
+
+    if (c < 0x80) {
+      if (j + 2 > size) break;
+      dst[j++] = c;
+    } else if (c < 0x800) {
+      if (j + 3 > size) break;
+      dst[j++] = 0xC0 | (c >> 6);
+      dst[j++] = 0x80 | (c & 0x3F);
+    } else if (c < 0x10000) {
+      if (j + 4 > size) break;
+      dst[j++] = 0xE0 | (c >> 12);
+      dst[j++] = 0x80 | ((c >> 6) & 0x3F);
+      dst[j++] = 0x80 | (c & 0x3F);
     } else {
-      fat_info.fat_type = FAT32;
-      fprintf(stderr, "FAT Type : FAT32\n");
+      if (j + 5 > size) break;
+      dst[j++] = 0xF0 | (c >> 18);
+      dst[j++] = 0x80 | ((c >> 12) & 0x3F);
+      dst[j++] = 0x80 | ((c >> 6) & 0x3F);
+      dst[j++] = 0x80 | (c & 0x3F);
     }
+  }
+  dst[j] = '\0';
+  return j;
+}
 
-    fprintf(stderr, "First FAT starts at byte %u (sector %u)\n", fat_info.addr_fat[0], fat_info.addr_fat[0] / fat_info.BS.bytes_per_sector);
-    fprintf(stderr, "Root directory starts at byte %u (sector %u)\n", fat_info.addr_root_dir, fat_info.addr_root_dir / fat_info.BS.bytes_per_sector);
-    fprintf(stderr, "Data area starts at byte %u (sector %u)\n", fat_info.addr_data, fat_info.addr_data / fat_info.BS.bytes_per_sector);
-    fprintf(stderr, "Total clusters : %d\n", fat_info.total_data_clusters);
+// Converts a nul terminated UTF-8 string into at most max code units.
+// Returns the number of code units, -ENAMETOOLONG if they do not fit, -EINVAL
+// if src is not valid UTF-8.
+static int utf8_to_utf16(const char * src, uint16_t * dst, int max) {
+  const uint8_t *p = (const uint8_t*) src;
+  int n = 0;
+
+  for (;;) {
+#ifdef __SSE2__
+    // Stop on any non ASCII byte, or on the terminator. The load may read
+    // past it, but never across a page boundary.
+    while (n + 16 <= max && ((uintptr_t) p & 4095) <= 4096 - 16) {
+      __m128i v = _mm_loadu_si128((const __m128i*) p);
+      if (_mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, _mm_setzero_si128()))) != 0)
+        break;
+      _mm_storeu_si128((__m128i*)(dst + n), _mm_unpacklo_epi8(v, _mm_setzero_si128()));
+      _mm_storeu_si128((__m128i*)(dst + n + 8), _mm_unpackhi_epi8(v, _mm_setzero_si128()));
+      p += 16;
+      n += 16;
+    }
+#endif
+    uint32_t c = *p++;
+    int extra;
+    if (c == 0)
+      return n;
+    if (c < 0x80) {
+      extra = 0;
+    } else if ((c & 0xE0) == 0xC0) {
+      c &= 0x1F;
+      extra = 1;
+    } else if ((c & 0xF0) == 0xE0) {
+      c &= 0x0F;
+      extra = 2;
+    } else if ((c & 0xF8) == 0xF0) {
+      c &= 0x07;
+      extra = 3;
+    } else {
+      return -EINVAL;
+    }
+    // Smallest code point for each sequence length, anything below is an
+    // overlong form.
+    static const uint32_t min_code[4] = { 0, 0x80, 0x800, 0x10000 };
+    uint32_t min = min_code[extra];
+    for (; extra > 0; extra--) {
+      if ((*p & 0xC0) != 0x80)
+        return -EINVAL;
+      c = (c << 6) | (*p++ & 0x3F);
+    }
+    if (c < min || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF))
+      return -EINVAL;
+
+    if (c >= 0x10000) {
+      if (n + 2 > max)
+        return -ENAMETOOLONG;
+      c -= 0x10000;
+      dst[n++] = 0xD800 | (c >> 10);
+      dst[n++] = 0xDC00 | (c & 0x3FF);
+    } else {
+      if (n + 1 > max)
+        return -ENAMETOOLONG;
+      dst[n++] = c;
+    }
+  }
+}
 
-    fat_info.file_alloc_table = (unsigned int*) malloc(sizeof(unsigned int) * fat_info.total_data_clusters);
+// Names are compared case insensitively. Folding covers ASCII, Latin-1,
+// Latin Extended-A, Greek and Cyrillic, which is what the upcase tables of
+// common FAT implementations change in practice.
+static uint32_t fold_char(uint32_t c) {
+  if (c >= 'A' && c <= 'Z')
+    return c + 0x20;
+  if (c < 0x80)
+    return c;
+  if ((c >= 0xC0 && c <= 0xDE && c != 0xD7) || (c >= 0x391 && c <= 0x3AB && c != 0x3A2) || (c >= 0x410 && c <= 0x42F))
+    return c + 0x20;
+  if (c >= 0x400 && c <= 0x40F)
+    return c + 0x50;
+  // Y with diaeresis : its lower case is in Latin-1.
+  if (c == 0x178)
+    return 0xFF;
+  if (c >= 0x100 && c <= 0x17F && c != 0x130 && c != 0x131 && c != 0x138 && c != 0x149 && c != 0x17F) {
+    // Pairs, upper case first, shifted by one between 0x139 and 0x148 and
+    // from 0x179 on.
+    if ((c >= 0x139 && c <= 0x148) || c >= 0x179)
+      return c & 1 ? c + 1 : c;
+    return c | 1;
+  }
+  return c;
+}
 
-    read_fat();
+// Decodes one UTF-8 character and moves p past it. Invalid bytes stand for
+// themselves.
+static uint32_t next_char(const char **p) {
+  const uint8_t *s = (const uint8_t*) *p;
+  uint32_t c = *s++;
+  int extra = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+  if (extra) {
+    uint32_t d = c & (0x3F >> extra);
+    int i;
+    for (i = 0; i < extra && (s[i] & 0xC0) == 0x80; i++)
+      d = (d << 6) | (s[i] & 0x3F);
+    if (i == extra) {
+      c = d;
+      s += extra;
+    }
   }
+  *p = (const char*) s;
+  return c;
 }
 
-static void fat_dir_entry_to_directory_entry(char *filename, fat_dir_entry_t *dir, directory_entry_t *entry) {
-  strcpy(entry->name, filename);
-  entry->cluster = dir->cluster_pointer;
-  entry->attributes = dir->file_attributes;
-  entry->size = dir->file_size;
-  entry->access_time = 
-      convert_datetime_fat_to_time_t(&dir->last_access_date, NULL);
-  entry->modification_time =
-      convert_datetime_fat_to_time_t(&dir->last_modif_date, &dir->last_modif_time);
-  entry->creation_time = 
-      convert_datetime_fat_to_time_t(&dir->create_date, &dir->create_time);
+static uint32_t name_hash(const char *name) {
+  uint32_t h = 2166136261u;
+  while (*name)
+    h = (h ^ fold_char(next_char(&name))) * 16777619u;
+  return h;
 }
 
-static directory_entry_t * decode_lfn_entry(lfn_entry_t* fdir) {
-  int j;
-  char filename[256];
-  uint8_t i_filename = 0;
-  uint8_t seq = fdir->seq_number - 0x40;
-  for (j = seq-1; j >= 0; j--) {
-    decode_long_file_name(filename + i_filename, &fdir[j]);
-    i_filename += 13;
+// If s starts with prefix, case folded, returns what follows it in s.
+static const char * fold_prefix(const char *s, const char *prefix) {
+  while (*prefix) {
+    if (*s == '\0' || fold_char(next_char(&s)) != fold_char(next_char(&prefix)))
+      return NULL;
   }
-  directory_entry_t *dir_entry = malloc(sizeof(directory_entry_t));
-  fat_dir_entry_to_directory_entry(filename, (fat_dir_entry_t*)&fdir[seq], dir_entry);
-  return dir_entry;
+  return s;
 }
 
-static void decode_short_file_name(char *filename, fat_dir_entry_t *fdir) {
-  int j, k;
-	int notspace = 0;
+static int name_equal(const char *a, const char *b) {
+  const char *rest = fold_prefix(a, b);
+  return rest != NULL && *rest == '\0';
+}
 
-  // Copy basis name.
-  for (j = 7; j >= 0; j--) {
-		if (notspace || fdir->utf8_short_name[j] != ' ') {
-			if (!notspace) {
-				notspace = j;
-			}
-			if (fdir->reserved && 0x08) {
-				filename[j] = tolower(fdir->utf8_short_name[j]);
-			} else {
-				filename[j] = fdir->utf8_short_name[j];
-			}
-		}
+// Lookup test : the hashes rule out nearly every other entry without
+// touching the names.
+static int entry_matches(const directory_entry_t *entry, const char *name, uint32_t hash) {
+  return entry->hash == hash && name_equal(entry->name, name);
+}
+
+static int neg_cache_lookup(const char *path) {
+  uint32_t hash = name_hash(path);
+  int i = hash % NEG_CACHE_SIZE;
+  pthread_mutex_lock(&neg_cache.lock);
+  int found = neg_cache.path[i] && neg_cache.hash[i] == hash && name_equal(neg_cache.path[i], path);
+  pthread_mutex_unlock(&neg_cache.lock);
+  return found;
+}
+
+static void neg_cache_insert(const char *path) {
+  uint32_t hash = name_hash(path);
+  int i = hash % NEG_CACHE_SIZE;
+  pthread_mutex_lock(&neg_cache.lock);
+  free(neg_cache.path[i]);
+  neg_cache.path[i] = strdup(path);
+  neg_cache.hash[i] = hash;
+  pthread_mutex_unlock(&neg_cache.lock);
+}
+
+// Forgets name in the directory at dir, or everything if name is NULL.
+static void neg_cache_remove(const char *dir, const char *name) {
+  int i;
+  pthread_mutex_lock(&neg_cache.lock);
+  if (name == NULL) {
+    for (i = 0; i < NEG_CACHE_SIZE; i++) {
+      free(neg_cache.path[i]);
+      neg_cache.path[i] = NULL;
+    }
+  } else {
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+    sprintf(path, "%s/%s", strcmp(dir, "/") == 0 ? "" : dir, name);
+    i = name_hash(path) % NEG_CACHE_SIZE;
+    if (neg_cache.path[i] && name_equal(neg_cache.path[i], path)) {
+      free(neg_cache.path[i]);
+      neg_cache.path[i] = NULL;
+    }
+    free(path);
+  }
+  pthread_mutex_unlock(&neg_cache.lock);
+}
+
+// Copies the 13 code units of one long name entry.
+static void lfn_entry_units(uint16_t * units, lfn_entry_t * long_file_name) {
+  memcpy(units, long_file_name->filename1, 10);
+  memcpy(units + 5, long_file_name->filename2, 12);
+  memcpy(units + 11, long_file_name->filename3, 4);
+}
+
+// The entries are stored last part first : long_file_name[0] holds the end of
+// the name and the 0x40 flag, long_file_name[n_entries - 1] its beginning.
+// After the name come a 0x0000 terminator, then 0xFFFF padding.
+static void encode_long_file_name(const uint16_t * units, int len, lfn_entry_t * long_file_name, int n_entries, uint8_t checksum) {
+  uint16_t part[13];
+  int i, j;
+  for (i = 0; i < n_entries; i++) {
+    lfn_entry_t * entry = &long_file_name[n_entries - 1 - i];
+    int base = i * 13;
+
+    for (j = 0; j < 13; j++)
+      part[j] = base + j < len ? units[base + j] : base + j == len ? 0x0000 : 0xFFFF;
+    entry->seq_number = (i + 1) | (i == n_entries - 1 ? 0x40 : 0);
+    entry->attributes = 0x0f;
+    entry->reserved = 0;
+    entry->checksum = checksum;
+    entry->cluster_pointer = 0;
+    memcpy(entry->filename1, part, 10);
+    memcpy(entry->filename2, part + 5, 12);
+    memcpy(entry->filename3, part + 11, 4);
+  }
+}
+
+static int last_cluster() {
+  if (fat_info.fat_type == FAT12) {
+    return 0xFFF;
+  } else if (fat_info.fat_type == FAT16) {
+    return 0xFFFF;
+  } else {
+    return 0x0FFFFFFF;
+  }
+}
+
+static int is_free_cluster(int cluster) {
+  return cluster == 0;
+}
+
+static int is_last_cluster(int cluster) {
+  if (fat_info.fat_type == FAT12) {
+    return cluster >= 0xFF8 && cluster <= 0xFFF;
+  } else if (fat_info.fat_type == FAT16) {
+    return cluster >= 0xFFF8 && cluster <= 0xFFFF;
+  } else {
+    return cluster >= 0x0FFFFFF8 && cluster <= 0x0FFFFFFF;
+  }
+}
+
+static int is_used_cluster(int cluster) {
+  if (fat_info.fat_type == FAT12) {
+    return cluster >= 0x002 && cluster <= 0xFEF;
+  } else if (fat_info.fat_type == FAT16) {
+    return cluster >= 0x0002 && cluster <= 0xFFEF;
+  } else {
+    return cluster >= 0x00000002 && cluster <= 0x0FFFFFEF;
+  }
+}
+
+// Byte offset of a data cluster on the device.
+static off_t cluster_addr(uint32_t cluster) {
+  return fat_info.addr_data + (off_t)(cluster - 2) * fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector;
+}
+
+static void convert_time_t_to_datetime_fat(time_t time, fat_time_t *timefat, fat_date_t *datefat) {
+  #define MINUTES 60
+  #define HOURS 3600
+  #define DAYS 86400
+
+  int days_per_month[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+  int days_per_month_leap[] = {31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+
+  int year = 1970;
+  int month = 0;
+  int day = 0;
+  int hours = 0;
+  int min = 0;
+  int sec = 0;
+
+  int secs_year = DAYS * 365;
+  int *dpm = days_per_month;
+
+  while (time) {
+    if (time >= secs_year) {
+      year++;
+      time -= secs_year;
+
+      if (!(year % 400 && (year % 100 == 0 || (year & 3)))) {
+        secs_year = DAYS * 366;
+        dpm = days_per_month_leap;
+      } else {
+        secs_year = DAYS * 365;
+        dpm = days_per_month;
+      }
+    } else {
+      if (time >= dpm[month] * DAYS) {
+        time -= dpm[month] * DAYS;
+        month++;
+      } else {
+        day = time / DAYS;
+        time -= day * DAYS;
+        hours = time / HOURS;
+        time -= hours * HOURS;
+        min = time / MINUTES;
+        time -= min * MINUTES;
+        sec = time;
+        time = 0;
+      }
+    }
+  }
+
+  datefat->year = year - 1980;
+  datefat->month = month + 1;
+  datefat->day = day + 1;
+  if (timefat) {
+    timefat->hours = hours;
+    timefat->minutes = min;
+    timefat->seconds2 = sec / 2;
+  }
+}
+
+static time_t convert_datetime_fat_to_time_t(fat_date_t *date, fat_time_t *time) {
+  int seconds, minutes, hours;
+
+  if (time) {
+    seconds = time->seconds2 * 2;
+    minutes = time->minutes;
+    hours = time->hours;
+  } else {
+    seconds = minutes = hours = 0;
+  }
+
+  struct tm t = {
+    .tm_sec = seconds,
+    .tm_min = minutes,
+    .tm_hour = hours,
+    .tm_mday = date->day,
+    .tm_mon = date->month - 1,
+    .tm_year = date->year + 80,
+  };
+
+  return mktime(&t);
+}
+
+static int load_index(uint64_t checksum);
+
+// 64 bits FNV-1a over words : the FAT is large, bytes would be slow.
+static uint64_t fat_checksum(const uint8_t *buffer, size_t size) {
+  uint64_t h = 14695981039346656037ull;
+  size_t i;
+  for (i = 0; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, buffer + i, 8);
+    h = (h ^ word) * 1099511628211ull;
+  }
+  for (; i < size; i++)
+    h = (h ^ buffer[i]) * 1099511628211ull;
+  return h;
+}
+
+static void read_fat() {
+  size_t size = (size_t) fat_info.BS.bytes_per_sector * fat_info.table_size;
+  uint8_t *buffer = malloc(size);
+
+  read_data(buffer, size, fat_info.addr_fat[fat_info.active_fat]);
+
+  // Already decoded by a previous mount.
+  if (!load_index(fat_checksum(buffer, size))) {
+    // FAT12 decodes by pairs.
+    uint32_t n = fat_info.total_data_clusters + 2;
+    if (fat_info.fat_type == FAT12)
+      n = (n + 1) & ~1;
+    fat_codec(fat_info.fat_type)->decode(buffer, fat_info.file_alloc_table, n);
+  }
+  free(buffer);
+}
+
+// Writes bytes at offset in the FAT. Every copy gets them, unless FAT32
+// mirroring is off (fat_flags bit 7), where only the active copy is used, or
+// lazy : the mirrors are then only marked behind, for sync_fat_mirrors.
+static void write_fat_bytes(void *buffer, size_t size, uint32_t offset) {
+  uint32_t i;
+
+  if (!fat_info.mirror_fat || fat_info.mirror_dirty) {
+    write_fat_data(buffer, size, fat_info.addr_fat[fat_info.active_fat] + offset);
+    if (fat_info.mirror_dirty && size > 0) {
+      for (i = offset / fat_info.BS.bytes_per_sector; i <= (offset + size - 1) / fat_info.BS.bytes_per_sector; i++)
+        fat_info.mirror_dirty[i] = 1;
+    }
+    return;
+  }
+  for (i = 0; i < fat_info.BS.table_count; i++)
+    write_fat_data(buffer, size, fat_info.addr_fat[i] + offset);
+}
+
+static void write_fat_entry(int index) {
+	if (fat_info.fat_type == FAT12) {
+		uint32_t tmp;
+		uint8_t buffer[3]; // 24 bits : 2 entries
+		index &= ~1;
+    tmp = (fat_info.file_alloc_table[index + 1] << 12) + (fat_info.file_alloc_table[index] & 0xFFF);
+    buffer[0] = tmp & 0xFF;
+    buffer[1] = (tmp >> 8) & 0xFF;
+    buffer[2] = (tmp >> 16) & 0xFF;
+
+		write_fat_bytes(buffer, sizeof(buffer), index * 3 / 2);
+  } else if (fat_info.fat_type == FAT16) {
+		uint8_t buffer[2];
+    buffer[0] = fat_info.file_alloc_table[index] & 0xFF;
+    buffer[1] = (fat_info.file_alloc_table[index] >> 8) & 0xFF;
+		write_fat_bytes(buffer, sizeof(buffer), index * 2);
+  } else if (fat_info.fat_type == FAT32) {
+		uint8_t buffer[4];
+    buffer[0] = fat_info.file_alloc_table[index] & 0xFF;
+    buffer[1] = (fat_info.file_alloc_table[index] >> 8) & 0xFF;
+    buffer[2] = (fat_info.file_alloc_table[index] >> 16) & 0xFF;
+    buffer[3] = (fat_info.file_alloc_table[index] >> 24) & 0xFF;
+		write_fat_bytes(buffer, sizeof(buffer), index * 4);
+  }
+ 
+}
+
+static alloc_group_t * group_of(uint32_t cluster) {
+  uint32_t g = cluster / alloc_group_size;
+  return &alloc_groups[g < n_alloc_groups ? g : n_alloc_groups - 1];
+}
+
+static void lock_all_groups() {
+  uint32_t g;
+  for (g = 0; g < n_alloc_groups; g++)
+    pthread_mutex_lock(&alloc_groups[g].lock);
+}
+
+static void unlock_all_groups() {
+  uint32_t g;
+  for (g = n_alloc_groups; g > 0; g--)
+    pthread_mutex_unlock(&alloc_groups[g - 1].lock);
+}
+
+// Update one FAT entry, keeping the free cluster counts in sync (called with
+// the lock of its group held).
+static void update_fat_entry(int index, unsigned int value) {
+  alloc_group_t *group = group_of(index);
+  if (fat_info.file_alloc_table[index] == 0 && value != 0) {
+    group->free--;
+    __atomic_sub_fetch(&fat_info.free_clusters, 1, __ATOMIC_RELAXED);
+  } else if (fat_info.file_alloc_table[index] != 0 && value == 0) {
+    group->free++;
+    __atomic_add_fetch(&fat_info.free_clusters, 1, __ATOMIC_RELAXED);
+  }
+  fat_info.file_alloc_table[index] = value;
+  fat_info.fs_info_dirty = 1;
+}
+
+static void set_fat_entry(int index, unsigned int value) {
+  alloc_group_t *group = group_of(index);
+  pthread_mutex_lock(&group->lock);
+  update_fat_entry(index, value);
+  write_fat_entry(index);
+  pthread_mutex_unlock(&group->lock);
+}
+
+// Byte offset in the FAT of the entry of cluster index.
+static uint32_t fat_entry_offset(uint32_t index) {
+  if (fat_info.fat_type == FAT12)
+    return index * 3 / 2;
+  else if (fat_info.fat_type == FAT16)
+    return index * 2;
+  else
+    return index * 4;
+}
+
+// Encodes sectors [first, first + n) of the FAT into buffer and returns the
+// number of bytes, less than n sectors at the end of the table.
+static uint32_t encode_fat_sectors(uint8_t *buffer, uint32_t first, uint32_t n) {
+  const fat_codec_t *codec = fat_codec(fat_info.fat_type);
+  uint32_t start = first * fat_info.BS.bytes_per_sector;
+  // Up to the end of the entry of the last cluster, which on FAT12 may end
+  // half way into a byte.
+  uint32_t end = fat_entry_offset(fat_info.total_data_clusters + 1) + (fat_info.fat_type == FAT32 ? 4 : 2);
+
+  if (start + n * fat_info.BS.bytes_per_sector < end)
+    end = start + n * fat_info.BS.bytes_per_sector;
+  if (end <= start)
+    return 0;
+  if (fat_info.fat_type == FAT12) {
+    // Sectors split entry pairs : the pairs covering them are encoded aside.
+    uint32_t pair = start / 3, pairs = (end + 2) / 3 - pair;
+    uint8_t *tmp = malloc(pairs * 3);
+    codec->encode(fat_info.file_alloc_table + pair * 2, tmp, pairs * 2);
+    memcpy(buffer, tmp + (start - pair * 3), end - start);
+    free(tmp);
+  } else {
+    uint32_t width = fat_info.fat_type == FAT16 ? 2 : 4;
+    codec->encode(fat_info.file_alloc_table + start / width, buffer, (end - start) / width);
+  }
+  return end - start;
+}
+
+// Writes sectors [first, first + n) of the FAT (called with the locks of the
+// groups they cover held).
+static void write_fat_sectors(uint32_t first, uint32_t n) {
+  uint8_t *buffer = malloc(n * fat_info.BS.bytes_per_sector);
+  uint32_t size = encode_fat_sectors(buffer, first, n);
+  write_fat_bytes(buffer, size, first * fat_info.BS.bytes_per_sector);
+  free(buffer);
+}
+
+// Brings the mirrors up to date with the active FAT : one write per copy and
+// run of sectors they lag behind on.
+static void sync_fat_mirrors() {
+  uint32_t s = 0, run, i;
+
+  if (fat_info.mirror_dirty == NULL)
+    return;
+  lock_all_groups();
+  while (s < fat_info.table_size) {
+    if (!fat_info.mirror_dirty[s]) {
+      s++;
+      continue;
+    }
+    for (run = 0; s + run < fat_info.table_size && fat_info.mirror_dirty[s + run]; run++)
+      fat_info.mirror_dirty[s + run] = 0;
+    uint8_t *buffer = malloc(run * fat_info.BS.bytes_per_sector);
+    uint32_t size = encode_fat_sectors(buffer, s, run);
+    for (i = 0; i < fat_info.BS.table_count; i++) {
+      if (i != fat_info.active_fat)
+        write_fat_data(buffer, size, fat_info.addr_fat[i] + s * fat_info.BS.bytes_per_sector);
+    }
+    free(buffer);
+    s += run;
+  }
+  unlock_all_groups();
+}
+
+// Writes the FAT sectors holding the entries of clusters, one write per run
+// of consecutive sectors (called with the locks of their groups held).
+static void write_fat_clusters(uint32_t *clusters, int n) {
+  uint8_t *dirty = calloc(fat_info.table_size, 1);
+  uint32_t first_dirty = fat_info.table_size, last_dirty = 0;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    uint32_t sector = fat_entry_offset(clusters[i]) / fat_info.BS.bytes_per_sector;
+    // FAT12 entries may straddle two sectors.
+    dirty[sector] = 1;
+    if (sector + 1 < fat_info.table_size)
+      dirty[sector + 1] |= fat_info.fat_type == FAT12;
+    if (sector < first_dirty)
+      first_dirty = sector;
+    if (sector + 1 > last_dirty)
+      last_dirty = sector + 1;
+  }
+
+  uint32_t s = first_dirty;
+  while (s <= last_dirty && s < fat_info.table_size) {
+    if (!dirty[s]) {
+      s++;
+      continue;
+    }
+    uint32_t run = 1;
+    while (s + run < fat_info.table_size && dirty[s + run])
+      run++;
+    write_fat_sectors(s, run);
+    s += run;
+  }
+  free(dirty);
+}
+
+// Frees a batch of clusters.
+static void free_clusters(uint32_t *clusters, int n) {
+  int i;
+
+  tx_begin();
+  lock_all_groups();
+  for (i = 0; i < n; i++) {
+    alloc_group_t *group = group_of(clusters[i]);
+    update_fat_entry(clusters[i], 0);
+    if (clusters[i] < group->next)
+      group->next = clusters[i];
+    if (clusters[i] < fat_info.next_free)
+      fat_info.next_free = clusters[i];
+  }
+  write_fat_clusters(clusters, n);
+  unlock_all_groups();
+  tx_commit();
+}
+
+// Walks a chain once and frees it in batches.
+static void reclaim_chain(uint32_t cluster) {
+  uint32_t *batch = malloc(sizeof(uint32_t) * RECLAIM_BATCH);
+  int n = 0;
+
+  while (is_used_cluster(cluster) && cluster < fat_info.total_data_clusters + 2) {
+    batch[n++] = cluster;
+    cluster = fat_info.file_alloc_table[cluster];
+    if (n == RECLAIM_BATCH) {
+      free_clusters(batch, n);
+      n = 0;
+    }
+  }
+  if (n > 0)
+    free_clusters(batch, n);
+  free(batch);
+}
+
+static void * reclaimer_thread(void *arg) {
+  pthread_mutex_lock(&reclaimer.lock);
+  for (;;) {
+    while (reclaimer.head == NULL && reclaimer.running)
+      pthread_cond_wait(&reclaimer.cond, &reclaimer.lock);
+    if (reclaimer.head == NULL)
+      break;
+
+    reclaim_chain_t *chain = reclaimer.head;
+    reclaimer.head = chain->next;
+    if (reclaimer.head == NULL)
+      reclaimer.tail = NULL;
+    pthread_mutex_unlock(&reclaimer.lock);
+
+    reclaim_chain(chain->cluster);
+    free(chain);
+
+    pthread_mutex_lock(&reclaimer.lock);
+  }
+  pthread_mutex_unlock(&reclaimer.lock);
+  return NULL;
+}
+
+static void start_reclaimer() {
+  reclaimer.running = 1;
+  if (pthread_create(&reclaimer.thread, NULL, reclaimer_thread, NULL) != 0)
+    reclaimer.running = 0;
+}
+
+// Frees what is still queued and waits for the thread.
+static void stop_reclaimer() {
+  if (!reclaimer.running)
+    return;
+  pthread_mutex_lock(&reclaimer.lock);
+  reclaimer.running = 0;
+  pthread_cond_signal(&reclaimer.cond);
+  pthread_mutex_unlock(&reclaimer.lock);
+  pthread_join(reclaimer.thread, NULL);
+}
+
+// Queues the chain starting at cluster, unlink returns without walking it.
+static void queue_reclaim(uint32_t cluster) {
+  if (!is_used_cluster(cluster))
+    return;
+  if (!reclaimer.running) {
+    reclaim_chain(cluster);
+    return;
+  }
+
+  reclaim_chain_t *chain = malloc(sizeof(reclaim_chain_t));
+  chain->cluster = cluster;
+  chain->next = NULL;
+  pthread_mutex_lock(&reclaimer.lock);
+  if (reclaimer.tail)
+    reclaimer.tail->next = chain;
+  else
+    reclaimer.head = chain;
+  reclaimer.tail = chain;
+  pthread_cond_signal(&reclaimer.cond);
+  pthread_mutex_unlock(&reclaimer.lock);
+}
+
+static void count_free_clusters() {
+  uint32_t i;
+  fat_info.free_clusters = 0;
+  fat_info.next_free = 0;
+  for (i = 2; i < fat_info.total_data_clusters + 2; i++) {
+    if (fat_info.file_alloc_table[i] == 0) {
+      if (fat_info.free_clusters == 0)
+        fat_info.next_free = i;
+      fat_info.free_clusters++;
+    }
+  }
+}
+
+// Splits the clusters into groups, at most ALLOC_GROUPS_MAX of at least
+// ALLOC_GROUP_MIN clusters, and counts the free ones in each. The counts
+// are authoritative : FSInfo is rewritten if it disagrees.
+static void init_alloc_groups() {
+  uint32_t total = fat_info.total_data_clusters;
+  uint32_t g, i, free = 0;
+
+  alloc_group_size = (total + ALLOC_GROUPS_MAX - 1) / ALLOC_GROUPS_MAX;
+  alloc_group_size = (alloc_group_size + ALLOC_GROUP_MIN - 1) / ALLOC_GROUP_MIN * ALLOC_GROUP_MIN;
+  n_alloc_groups = (total + 2 + alloc_group_size - 1) / alloc_group_size;
+  alloc_groups = calloc(n_alloc_groups, sizeof(alloc_group_t));
+  for (g = 0; g < n_alloc_groups; g++) {
+    alloc_group_t *group = &alloc_groups[g];
+    pthread_mutex_init(&group->lock, NULL);
+    group->start = g > 0 ? g * alloc_group_size : 2;
+    group->end = g + 1 < n_alloc_groups ? (g + 1) * alloc_group_size : total + 2;
+    group->next = group->start;
+    for (i = group->start; i < group->end; i++)
+      group->free += fat_info.file_alloc_table[i] == 0;
+    free += group->free;
+  }
+  for (i = 0; i < FILE_LOCKS; i++)
+    pthread_mutex_init(&file_locks[i], NULL);
+
+  if (free != fat_info.free_clusters) {
+    fat_info.free_clusters = free;
+    fat_info.fs_info_dirty = fat_info.fat_type == FAT32;
+  }
+  fprintf(stderr, "%u allocation groups of %u clusters\n", n_alloc_groups, alloc_group_size);
+}
+
+// FAT32 keeps the free cluster count and an allocation hint in the FSInfo
+// sector. Trust them when they look sane, otherwise count once.
+static void read_fs_info() {
+  fat_info.fs_info_dirty = 0;
+
+  if (fat_info.fat_type == FAT32 && fat_info.ext_BIOS_32->sector_fs_info > 0) {
+    fat_fs_info_t fs_info;
+    read_data(&fs_info, sizeof(fat_fs_info_t), fat_info.ext_BIOS_32->sector_fs_info * fat_info.BS.bytes_per_sector);
+
+    if (fs_info.lead_signature == FS_INFO_LEAD_SIGNATURE &&
+        fs_info.struct_signature == FS_INFO_STRUCT_SIGNATURE &&
+        fs_info.free_count <= fat_info.total_data_clusters &&
+        fs_info.next_free >= 2 && fs_info.next_free < fat_info.total_data_clusters + 2) {
+      fat_info.free_clusters = fs_info.free_count;
+      fat_info.next_free = fs_info.next_free;
+      fprintf(stderr, "FSInfo : %u free clusters, next free %u\n", fat_info.free_clusters, fat_info.next_free);
+      return;
+    }
+  }
+
+  count_free_clusters();
+  // The FSInfo sector was unusable: rewrite it with the computed values.
+  if (fat_info.fat_type == FAT32)
+    fat_info.fs_info_dirty = 1;
+  fprintf(stderr, "Free clusters : %u\n", fat_info.free_clusters);
+}
+
+// Written back lazily, on flush and unmount.
+static void write_fs_info() {
+  if (!fat_info.fs_info_dirty)
+    return;
+  fat_info.fs_info_dirty = 0;
+
+  if (fat_info.fat_type != FAT32 || fat_info.ext_BIOS_32->sector_fs_info == 0)
+    return;
+
+  fat_fs_info_t fs_info;
+  off_t addr = fat_info.ext_BIOS_32->sector_fs_info * fat_info.BS.bytes_per_sector;
+  read_data(&fs_info, sizeof(fat_fs_info_t), addr);
+  fs_info.lead_signature = FS_INFO_LEAD_SIGNATURE;
+  fs_info.struct_signature = FS_INFO_STRUCT_SIGNATURE;
+  fs_info.trail_signature = FS_INFO_TRAIL_SIGNATURE;
+  fs_info.free_count = fat_info.free_clusters;
+  fs_info.next_free = fat_info.next_free;
+  write_data(&fs_info, sizeof(fat_fs_info_t), addr);
+}
+
+static void mount_fat() {
+  fprintf(stderr, "Mount FAT.\n");
+  {
+		device->read(&fat_info.BS, sizeof(fat_BS_t), 0);
+    
+    if (fat_info.BS.table_size_16 == 0) { // Si 0 alors on considère qu'on est en FAT32.
+      fat_info.ext_BIOS_16 = NULL;
+      fat_info.ext_BIOS_32 = malloc(sizeof(fat_extended_BIOS_32_t));
+      device->read(fat_info.ext_BIOS_32, sizeof(fat_extended_BIOS_32_t), sizeof(fat_BS_t));
+      fat_info.table_size = fat_info.ext_BIOS_32->table_size_32;
+    } else {
+      fat_info.ext_BIOS_32 = NULL;
+      fat_info.ext_BIOS_16 = malloc(sizeof(fat_extended_BIOS_16_t));
+      device->read(fat_info.ext_BIOS_16, sizeof(fat_extended_BIOS_16_t), sizeof(fat_BS_t));
+      fat_info.table_size = fat_info.BS.table_size_16;
+    }
+
+    fprintf(stderr, "table size : %d\n", fat_info.table_size);
+
+
+    fprintf(stderr, "%d bytes per logical sector\n", fat_info.BS.bytes_per_sector);
+    fprintf(stderr, "%d bytes per clusters\n", fat_info.BS.bytes_per_sector * fat_info.BS.sectors_per_cluster);
+ 
+    fat_info.addr_fat = (unsigned int*) malloc(sizeof(unsigned int) * fat_info.BS.table_count);
+    
+    int i;
+    for (i = 0; i < fat_info.BS.table_count; i++) {
+      fat_info.addr_fat[i] = (fat_info.BS.reserved_sector_count + i * fat_info.table_size) * fat_info.BS.bytes_per_sector;
+    }
+    fat_info.addr_root_dir = (fat_info.BS.reserved_sector_count + fat_info.BS.table_count * fat_info.table_size) * fat_info.BS.bytes_per_sector;
+    fat_info.addr_data = fat_info.addr_root_dir + (fat_info.BS.root_entry_count * sizeof(fat_dir_entry_t));
+    if (fat_info.BS.total_sectors_16 > 0)
+      fat_info.total_data_clusters = fat_info.BS.total_sectors_16 / fat_info.BS.sectors_per_cluster - fat_info.addr_data / (fat_info.BS.bytes_per_sector * fat_info.BS.sectors_per_cluster);
+    else
+      fat_info.total_data_clusters = fat_info.BS.total_sectors_32 / fat_info.BS.sectors_per_cluster - fat_info.addr_data / (fat_info.BS.bytes_per_sector * fat_info.BS.sectors_per_cluster);
+
+    if (fat_info.total_data_clusters < 4086) {
+      fat_info.fat_type = FAT12;
+      fprintf(stderr, "FAT Type : FAT12\n");
+    } else if (fat_info.total_data_clusters < 65526) {
+      fat_info.fat_type = FAT16;
+      fprintf(stderr, "FAT Type : FAT16\n");
+    } else {
+      fat_info.fat_type = FAT32;
+      fprintf(stderr, "FAT Type : FAT32\n");
+    }
+
+    fprintf(stderr, "First FAT starts at byte %u (sector %u)\n", fat_info.addr_fat[0], fat_info.addr_fat[0] / fat_info.BS.bytes_per_sector);
+    fprintf(stderr, "Root directory starts at byte %u (sector %u)\n", fat_info.addr_root_dir, fat_info.addr_root_dir / fat_info.BS.bytes_per_sector);
+    fprintf(stderr, "Data area starts at byte %u (sector %u)\n", fat_info.addr_data, fat_info.addr_data / fat_info.BS.bytes_per_sector);
+    fprintf(stderr, "Total clusters : %d\n", fat_info.total_data_clusters);
+    if (device->size() < fat_info.addr_data + (off_t) fat_info.total_data_clusters * fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector)
+      fprintf(stderr, "Warning : the %s backend is smaller than the volume.\n", device->name);
+
+    // FAT32 may turn mirroring off and name the one copy in use.
+    fat_info.active_fat = 0;
+    fat_info.mirror_fat = fat_info.BS.table_count > 1;
+    if (fat_info.fat_type == FAT32 && fat_info.ext_BIOS_32 && (fat_info.ext_BIOS_32->fat_flags & 0x80)) {
+      fat_info.active_fat = fat_info.ext_BIOS_32->fat_flags & 0x0F;
+      if (fat_info.active_fat >= fat_info.BS.table_count)
+        fat_info.active_fat = 0;
+      fat_info.mirror_fat = 0;
+      fprintf(stderr, "FAT mirroring disabled, active FAT : %u\n", fat_info.active_fat);
+    }
+    if (fat_info.mirror_fat && options.lazy_mirror)
+      fat_info.mirror_dirty = calloc(fat_info.table_size, 1);
+
+    // Indexed by cluster number : entries 0 and 1 are reserved, FAT12 decodes by pairs.
+    fat_info.file_alloc_table = (unsigned int*) calloc(fat_info.total_data_clusters + 3, sizeof(unsigned int));
+
+    read_fat();
+    read_fs_info();
+    init_alloc_groups();
+  }
+}
+
+// FAT32 keeps the high 16 bits of the first cluster in ea_index.
+static uint32_t entry_cluster(fat_dir_entry_t *fdir) {
+  if (fat_info.fat_type == FAT32)
+    return fdir->cluster_pointer | ((uint32_t) fdir->ea_index << 16);
+  return fdir->cluster_pointer;
+}
+
+static void set_entry_cluster(fat_dir_entry_t *fdir, uint32_t cluster) {
+  fdir->cluster_pointer = cluster & 0xFFFF;
+  fdir->ea_index = fat_info.fat_type == FAT32 ? cluster >> 16 : 0;
+}
+
+static void fat_dir_entry_to_directory_entry(char *filename, fat_dir_entry_t *dir, directory_entry_t *entry) {
+  strcpy(entry->name, filename);
+  entry->hash = name_hash(filename);
+  entry->cluster = entry_cluster(dir);
+  entry->attributes = dir->file_attributes;
+  entry->size = dir->file_size;
+  entry->access_time = 
+      convert_datetime_fat_to_time_t(&dir->last_access_date, NULL);
+  entry->modification_time =
+      convert_datetime_fat_to_time_t(&dir->last_modif_date, &dir->last_modif_time);
+  entry->creation_time = 
+      convert_datetime_fat_to_time_t(&dir->create_date, &dir->create_time);
+}
+
+// Decodes the long name starting at fdir and the short entry behind it, n
+// entries are left in the buffer. Returns NULL if the sequence number is
+// corrupt or the entries run past the buffer.
+static directory_entry_t * decode_lfn_entry(lfn_entry_t* fdir, int n) {
+  int j;
+  char filename[LFN_NAME_MAX];
+  uint16_t units[LFN_MAX_ENTRIES * 13];
+  int seq = fdir->seq_number & 0x1F;
+  if (seq < 1 || seq > LFN_MAX_ENTRIES || seq >= n)
+    return NULL;
+  for (j = seq-1; j >= 0; j--)
+    lfn_entry_units(units + (seq - 1 - j) * 13, &fdir[j]);
+  utf16_to_utf8(units, seq * 13, filename, sizeof(filename));
+  directory_entry_t *dir_entry = malloc(sizeof(directory_entry_t));
+  fat_dir_entry_to_directory_entry(filename, (fat_dir_entry_t*)&fdir[seq], dir_entry);
+  return dir_entry;
+}
+
+static void decode_short_file_name(char *filename, fat_dir_entry_t *fdir) {
+  int j, k;
+	int notspace = 0;
+
+  // Copy basis name.
+  for (j = 7; j >= 0; j--) {
+		if (notspace || fdir->utf8_short_name[j] != ' ') {
+			if (!notspace) {
+				notspace = j;
+			}
+			if (fdir->reserved && 0x08) {
+				filename[j] = tolower(fdir->utf8_short_name[j]);
+			} else {
+				filename[j] = fdir->utf8_short_name[j];
+			}
+		}
+  }
+  
+	notspace++; // notspace est la position du premier caractère != ' '
+  filename[notspace++] = '.';
+
+	int notspaceext = -2;
+  // Copy extension.
+  for (k = 2; k >= 0; k--) {
+		if (notspaceext > 0 || fdir->file_extension[k] != ' ') {
+			if (notspaceext <= 0) {
+				notspaceext = k;
+			}
+			if (fdir->reserved && 0x10) {
+				filename[notspace + k] = tolower(fdir->file_extension[k]);
+			} else {
+				filename[notspace + k] = fdir->file_extension[k];
+			}
+		}
+  }
+
+	filename[notspace + notspaceext + 1] = '\0';
+
+
+}
+
+static directory_entry_t * decode_sfn_entry(fat_dir_entry_t *fdir) {
+  char filename[LFN_NAME_MAX];
+	decode_short_file_name(filename, fdir);
+  directory_entry_t *dir_entry = malloc(sizeof(directory_entry_t));
+  fat_dir_entry_to_directory_entry(filename, fdir, dir_entry);
+  return dir_entry;
+}
+
+// Allocates n clusters as a chain appended to prev (0 for a new chain) and
+// returns its first cluster, 0 if there is not enough room. The search starts
+// at goal, in its group, then moves to the following groups : a file keeps
+// growing where it is, and stays contiguous while its group has room. Within
+// a group the clusters are linked under its lock, the links between groups
+// afterwards, so that no two group locks are ever held at once.
+static uint32_t alloc_chain(uint32_t goal, uint32_t prev, uint32_t n) {
+  uint32_t *claimed = malloc(sizeof(uint32_t) * n);
+  uint32_t got = 0, tail = prev, first = 0;
+  uint32_t g, tries;
+
+  if (goal < 2 || goal >= fat_info.total_data_clusters + 2)
+    goal = alloc_groups[__atomic_fetch_add(&next_alloc_group, 1, __ATOMIC_RELAXED) % n_alloc_groups].start;
+  g = group_of(goal) - alloc_groups;
+
+  for (tries = 0; tries < n_alloc_groups && got < n; tries++, g = (g + 1) % n_alloc_groups) {
+    alloc_group_t *group = &alloc_groups[g];
+    uint32_t segment = got;
+    pthread_mutex_lock(&group->lock);
+    uint32_t i = tries == 0 && goal >= group->start ? goal : group->next;
+    uint32_t scanned;
+    for (scanned = 0; scanned < group->end - group->start && got < n && group->free > 0; scanned++, i++) {
+      if (i >= group->end)
+        i = group->start;
+      if (fat_info.file_alloc_table[i] != 0)
+        continue;
+      update_fat_entry(i, last_cluster());
+      if (got > segment)
+        update_fat_entry(claimed[got - 1], i);
+      claimed[got++] = i;
+      group->next = i + 1 < group->end ? i + 1 : group->start;
+    }
+    if (got > segment)
+      write_fat_clusters(claimed + segment, got - segment);
+    pthread_mutex_unlock(&group->lock);
+
+    if (got > segment) {
+      if (tail)
+        set_fat_entry(tail, claimed[segment]);
+      else
+        first = claimed[segment];
+      tail = claimed[got - 1];
+    }
+  }
+
+  if (got < n) {
+    // Out of space : undo.
+    if (prev && got > 0)
+      set_fat_entry(prev, last_cluster());
+    if (got > 0)
+      free_clusters(claimed, got);
+    free(claimed);
+    return 0;
+  }
+  if (first == 0)
+    first = claimed[0];
+  fat_info.next_free = tail + 1;
+  free(claimed);
+  return first;
+}
+
+// Starts a new chain of n clusters in the next group, round robin. Returns
+// -1 if there is no room.
+static int alloc_cluster(int n) {
+  uint32_t first = alloc_chain(0, 0, n);
+  return first ? (int) first : -1;
+}
+
+static int updatedate_dir_entry(int cluster, char * filename, time_t accessdate, time_t modifdate) {
+  uint32_t hash = name_hash(filename);
+  directory_entry_t *dir_entry;
+  int n_clusters = 0;
+
+  if (cluster > 0) {
+    int next = cluster;
+    while (!is_last_cluster(next)) {
+      next = fat_info.file_alloc_table[next];
+      n_clusters++;
+    }
+  
+    int n_dir_entries = fat_info.BS.bytes_per_sector * fat_info.BS.sectors_per_cluster / sizeof(fat_dir_entry_t);
+    fat_dir_entry_t * fdir = malloc(n_dir_entries * sizeof(fat_dir_entry_t) * n_clusters);
+  
+    int c = 0;
+    next = cluster;
+    while (!is_last_cluster(next)) {
+      read_data(fdir + c * n_dir_entries, n_dir_entries * sizeof(fat_dir_entry_t), fat_info.addr_data + (next - 2) * fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector);
+      next = fat_info.file_alloc_table[next];
+      c++;
+    }
+  
+    int i;
+    for (i = 0; i < n_dir_entries * n_clusters && fdir[i].utf8_short_name[0]; i++) {
+      if ((unsigned char)fdir[i].utf8_short_name[0] != 0xE5) {
+        if (fdir[i].file_attributes == 0x0F && ((lfn_entry_t*) &fdir[i])->seq_number & 0x40) {
+          dir_entry = decode_lfn_entry((lfn_entry_t*) &fdir[i], n_dir_entries * n_clusters - i);
+          if (dir_entry == NULL)
+            continue;
+          uint8_t seq = ((lfn_entry_t*) &fdir[i])->seq_number & 0x1F;
+          i += seq;
+        } else {
+          dir_entry = decode_sfn_entry(&fdir[i]);
+        }
+  
+        if (entry_matches(dir_entry, filename, hash)) {
+          next = cluster;
+          while (i >= n_dir_entries) {
+            i -= n_dir_entries;
+            next = fat_info.file_alloc_table[next];
+          }
+          convert_time_t_to_datetime_fat(accessdate, NULL, &(fdir[i].last_access_date));
+          convert_time_t_to_datetime_fat(modifdate, &(fdir[i].last_modif_time), &(fdir[i].last_modif_date));
+          write_data(&fdir[i], sizeof(fat_dir_entry_t), fat_info.addr_data + (next - 2) * fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector + i * sizeof(fat_dir_entry_t));
+					free(fdir);
+          return 0;
+        }
+        free(dir_entry);
+      }
+    }
+  } else {
+    fat_dir_entry_t *fdir = malloc(sizeof(fat_dir_entry_t) * fat_info.BS.root_entry_count);
+    read_data(fdir, sizeof(fat_dir_entry_t) * fat_info.BS.root_entry_count, fat_info.addr_root_dir);
+ 
+    int i;
+    for (i = 0; i < fat_info.BS.root_entry_count && fdir[i].utf8_short_name[0]; i++) {
+      if ((unsigned char)fdir[i].utf8_short_name[0] != 0xE5) {
+        if (fdir[i].file_attributes == 0x0F && ((lfn_entry_t*) &fdir[i])->seq_number & 0x40) {
+          dir_entry = decode_lfn_entry((lfn_entry_t*) &fdir[i], fat_info.BS.root_entry_count - i);
+          if (dir_entry == NULL)
+            continue;
+          uint8_t seq = ((lfn_entry_t*) &fdir[i])->seq_number & 0x1F;
+          i += seq;
+        } else {
+          dir_entry = decode_sfn_entry(&fdir[i]);
+        }
+  
+        if (entry_matches(dir_entry, filename, hash)) {
+          convert_time_t_to_datetime_fat(accessdate, NULL, &(fdir[i].last_access_date));
+          convert_time_t_to_datetime_fat(modifdate, &(fdir[i].last_modif_time), &(fdir[i].last_modif_date));
+          write_data(&fdir[i], sizeof(fat_dir_entry_t), fat_info.addr_root_dir + i * sizeof(fat_dir_entry_t));
+					free(fdir);
+  
+          return 0;
+        }
+        free(dir_entry);
+      }
+    }
+  }
+
+
+  return 1;
+}
+
+// Marks the entries of name as deleted. Returns the index of the first one
+// and stores how many were deleted in count and the short name in sfn, -1
+// if name is not found.
+static int delete_dir_entry(fat_dir_entry_t *fdir, const char *name, int n, int *count, char *sfn) {
+	fprintf(debug, "delete_dir_entry %s %d\n", name, n);
+	fflush(debug);
+  char filename[LFN_NAME_MAX];
+  uint16_t units[LFN_MAX_ENTRIES * 13];
+  int i;
+
+  for (i = 0; i < n && fdir[i].utf8_short_name[0]; i++) {
+		fprintf(debug, "> %s\n", fdir[i].utf8_short_name);
+    if ((unsigned char)fdir[i].utf8_short_name[0] != 0xE5) {
+      if (fdir[i].file_attributes == 0x0F && ((lfn_entry_t*) &fdir[i])->seq_number & 0x40) {
+
+			  int j;
+			  int seq = ((lfn_entry_t*) &fdir[i])->seq_number & 0x1F;
+			  if (i + seq >= n)
+			    break;
+			  for (j = seq-1; j >= 0; j--)
+			    lfn_entry_units(units + (seq - 1 - j) * 13, (lfn_entry_t*) &fdir[i+j]);
+			  utf16_to_utf8(units, seq * 13, filename, sizeof(filename));
+
+				fprintf(debug, "cmp %s %s\n", filename, name);
+				fflush(debug);
+				if (name_equal(filename, name)) {
+					memcpy(sfn, fdir[i+seq].utf8_short_name, 11);
+					for (j = seq; j >= 0; j--) {
+						fdir[i+j].utf8_short_name[0] = 0xE5;
+					}
+					*count = seq + 1;
+					return i;
+				}
+        i += seq;
+      } else {
+        decode_short_file_name(filename, &fdir[i]);
+				if (name_equal(filename, name)) {
+					memcpy(sfn, fdir[i].utf8_short_name, 11);
+					fdir[i].utf8_short_name[0] = 0xE5;
+					*count = 1;
+					return i;
+				}
+      }
+    }
+  }
+	return -1;
+}
+
+static void read_dir_entries(fat_dir_entry_t *fdir, directory_t *dir, int n) {
+	fprintf(debug, "read_dir_entries\n");
+	fflush(debug);
+  directory_entry_t **tail = &dir->entries;
+  while (*tail)
+    tail = &(*tail)->next;
+  int i;
+  for (i = 0; i < n && fdir[i].utf8_short_name[0]; i++) {
+    directory_entry_t * dir_entry;
+
+    if ((unsigned char)fdir[i].utf8_short_name[0] != 0xE5) {
+      if (fdir[i].file_attributes == 0x0F && ((lfn_entry_t*) &fdir[i])->seq_number & 0x40) {
+        dir_entry = decode_lfn_entry((lfn_entry_t*) &fdir[i], n - i);
+        // Corrupt sequence number.
+        if (dir_entry == NULL)
+          continue;
+        uint8_t seq = ((lfn_entry_t*) &fdir[i])->seq_number & 0x1F;
+        i += seq;
+      } else {
+        dir_entry = decode_sfn_entry(&fdir[i]);
+      }
+      // Keep the on-disk order.
+      dir_entry->next = NULL;
+      *tail = dir_entry;
+      tail = &dir_entry->next;
+      dir->total_entries++;
+    }
+  }
+}
+
+static void free_dir_entries(directory_entry_t *dentry) {
+  while (dentry) {
+    directory_entry_t *next = dentry->next;
+    free(dentry);
+    dentry = next;
+  }
+}
+
+static void close_dir(directory_t *dir) {
+  if (dir) {
+    free_dir_entries(dir->entries);
+    free(dir);
+  }
+}
+
+static void release_dir_slots(int cluster, int first, int count, const char *sfn);
+
+// Deletes the entries of name and returns the first cluster of its chain,
+// 0 if it is not found.
+static uint32_t delete_file_dir(int cluster, const char * name) {
+  uint32_t chain = 0;
+  int n_dir_entries = fat_info.BS.bytes_per_sector * fat_info.BS.sectors_per_cluster / sizeof(fat_dir_entry_t);
+  int first, count;
+  char sfn[11];
+	if (cluster >= 0) {
+
+	  int n_clusters = 0;
+	  int next = cluster;
+	  while (!is_last_cluster(next)) {
+	    next = fat_info.file_alloc_table[next];
+	    n_clusters++;
+	  }
+	
+	  fat_dir_entry_t * sub_dir = malloc(n_dir_entries * sizeof(fat_dir_entry_t) * n_clusters);
+	  uint32_t * clusters = malloc(sizeof(uint32_t) * n_clusters);
+	
+	  int c = 0;
+	  next = cluster;
+	  while (!is_last_cluster(next)) {
+	    read_data(sub_dir + c * n_dir_entries, n_dir_entries * sizeof(fat_dir_entry_t), cluster_addr(next));
+	    clusters[c] = next;
+	    next = fat_info.file_alloc_table[next];
+	    c++;
+	  }
+	
+		if ((first = delete_dir_entry(sub_dir, name, n_dir_entries * n_clusters, &count, sfn)) >= 0) {
+			// Only the deleted slots are written back, the other entries of the
+			// directory may be updated meanwhile by writers of other files.
+			int k;
+			for (k = first; k < first + count; k++)
+				write_data(&sub_dir[k], sizeof(fat_dir_entry_t), cluster_addr(clusters[k / n_dir_entries]) + (k % n_dir_entries) * sizeof(fat_dir_entry_t));
+			release_dir_slots(cluster, first, count, sfn);
+			chain = entry_cluster(&sub_dir[first + count - 1]);
+	
+		} else {
+			fprintf(debug, "delete_file_dir failed\n");
+		}
+		free(sub_dir);
+		free(clusters);
+	
+	} else {
+    fat_dir_entry_t *root_dir = malloc(sizeof(fat_dir_entry_t) * fat_info.BS.root_entry_count);
+    read_data(root_dir, sizeof(fat_dir_entry_t) * fat_info.BS.root_entry_count, fat_info.addr_root_dir);
+		if ((first = delete_dir_entry(root_dir, name, fat_info.BS.root_entry_count, &count, sfn)) >= 0) {
+			write_data(&root_dir[first], sizeof(fat_dir_entry_t) * count, fat_info.addr_root_dir + first * sizeof(fat_dir_entry_t));
+			release_dir_slots(cluster, first, count, sfn);
+			chain = entry_cluster(&root_dir[first + count - 1]);
+		} else {
+			fprintf(debug, "delete_file_dir failed\n");
+		}
+		free(root_dir);
+	}
+	return chain;
+}
+
+static void open_dir(int cluster, directory_t *dir) {
+  int n_clusters = 0;
+  int next = cluster;
+  while (!is_last_cluster(next)) {
+    next = fat_info.file_alloc_table[next];
+    n_clusters++;
+  }
+
+  int n_dir_entries = fat_info.BS.bytes_per_sector * fat_info.BS.sectors_per_cluster / sizeof(fat_dir_entry_t);
+  fat_dir_entry_t * sub_dir = malloc(n_dir_entries * sizeof(fat_dir_entry_t) * n_clusters);
+
+  int c = 0;
+  next = cluster;
+  while (!is_last_cluster(next)) {
+    read_data(sub_dir + c * n_dir_entries, n_dir_entries * sizeof(fat_dir_entry_t), fat_info.addr_data + (next - 2) * fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector);
+    next = fat_info.file_alloc_table[next];
+    c++;
+  }
+
+  dir->cluster = cluster;
+  dir->total_entries = 0;
+  dir->entries = NULL;
+
+  read_dir_entries(sub_dir, dir, n_dir_entries * n_clusters);
+}
+
+static directory_t * open_root_dir() {
+	fprintf(debug, "open_root_dir\n");
+	fflush(debug);
+  directory_t *dir = malloc(sizeof(directory_t));
+
+  if (fat_info.fat_type == FAT32) {
+    open_dir(fat_info.ext_BIOS_32->cluster_root_dir, dir);
+  } else {
+    fat_dir_entry_t *root_dir = malloc(sizeof(fat_dir_entry_t) * fat_info.BS.root_entry_count);
+  
+    read_data(root_dir, sizeof(fat_dir_entry_t) * fat_info.BS.root_entry_count, fat_info.addr_root_dir);
+  
+    dir->cluster = -1;
+    dir->total_entries = 0;
+    dir->entries = NULL;
+  
+    read_dir_entries(root_dir, dir, fat_info.BS.root_entry_count);
+  
+    free(root_dir);
+  }
+
+  return dir;
+}
+
+static int open_next_dir(directory_t * prev_dir, directory_t * next_dir, char * name) {
+  fprintf(debug, "open_next_dir, name = %s\n", name);
+	fprintf(debug, "open_next_dir, prev_dir->cluster = %d\n", prev_dir->cluster);
+  fflush(debug);
+
+  int next = 0;
+
+  uint32_t hash = name_hash(name);
+  directory_entry_t *dentry = prev_dir->entries;
+  while (dentry) {
+    if (entry_matches(dentry, name, hash)) {
+      if ((dentry->attributes & 0x10) == 0x10) { //c'est bien un repe
+        next = dentry->cluster;
+        break;
+      } else {
+        return 2;
+      }
+    }
+    dentry = dentry->next;
+  }
+
+  if (next == 0) {
+    return 1;
+  }
+
+  directory_entry_t *prev_entries = prev_dir->entries;
+  open_dir(next, next_dir);
+  if (prev_dir == next_dir)
+    free_dir_entries(prev_entries);
+
+  return 0;
+}
+
+// filename must hold LFN_NAME_MAX bytes.
+static int split_dir_filename(const char * path, char * dir, char * filename) {
+  char *p = strrchr(path, '/');
+  if (strlen(p+1) >= LFN_NAME_MAX)
+    return -ENAMETOOLONG;
+  strcpy(filename, p+1);
+  for (; path < p; path++, dir++) {
+    *dir = *path;
+  } 
+  *dir = '\0';
+  return 0;
+}
+
+static directory_t * open_dir_from_path(const char *path) {
+  fprintf(debug, "open_dir_from_path %s\n", path);
+  fflush(debug);
+
+  if (path[0] == '\0' || strcmp(path, "/") == 0)
+    return open_root_dir();
+
+  // Only absolute paths.
+  if (path[0] != '/')
+    return NULL;
+
+  char buf[LFN_NAME_MAX];
+  int i = 1;
+  while (path[i] == '/')
+    i++;
+
+  directory_t * dir = open_root_dir();
+
+  int j = 0;
+  do {
+    if (path[i] == '/' || path[i] == '\0') {
+      buf[j] = '\0';
+
+      if (j > 0 && open_next_dir(dir, dir, buf) != 0)
+        return NULL;
+
+      j = 0;
+    } else {
+      if (j == LFN_NAME_MAX - 1) {
+        close_dir(dir);
+        return NULL;
+      }
+      buf[j] = path[i];
+      j++;
+    }
+  } while (path[i++] != '\0');
+
+  return dir;
+}
+
+static directory_entry_t * open_file_from_path(const char *path) {
+  char * dir = malloc(strlen(path));
+  char filename[LFN_NAME_MAX];
+  if (split_dir_filename(path, dir, filename) != 0) {
+    free(dir);
+    return NULL;
+  }
+
+  directory_t * directory = open_dir_from_path(dir);
+  free(dir);
+  if (directory == NULL)
+    return NULL;
+
+  uint32_t hash = name_hash(filename);
+  directory_entry_t **link = &directory->entries;
+  while (*link) {
+    directory_entry_t *dir_entry = *link;
+    if (entry_matches(dir_entry, filename, hash)) {
+      *link = dir_entry->next;
+      close_dir(directory);
+      return dir_entry;
+    }
+    link = &dir_entry->next;
   }
+
+  close_dir(directory);
   
-	notspace++; // notspace est la position du premier caractère != ' '
-  filename[notspace++] = '.';
+  return NULL;
+}
 
-	int notspaceext = -2;
-  // Copy extension.
-  for (k = 2; k >= 0; k--) {
-		if (notspaceext > 0 || fdir->file_extension[k] != ' ') {
-			if (notspaceext <= 0) {
-				notspaceext = k;
-			}
-			if (fdir->reserved && 0x10) {
-				filename[notspace + k] = tolower(fdir->file_extension[k]);
-			} else {
-				filename[notspace + k] = fdir->file_extension[k];
-			}
-		}
+// Returns in cluster the first cluster of the directory at path (-1 for the
+// FAT12/16 root directory), or a negative errno.
+static int open_dir_cluster(const char *path, int *cluster) {
+  if (path[0] == '\0' || strcmp(path, "/") == 0) {
+    *cluster = fat_info.fat_type == FAT32 ? (int) fat_info.ext_BIOS_32->cluster_root_dir : -1;
+    return 0;
   }
 
-	filename[notspace + notspaceext + 1] = '\0';
+  directory_entry_t *dir_entry = open_file_from_path(path);
+  if (dir_entry == NULL)
+    return -ENOENT;
+  int ret = 0;
+  if (dir_entry->attributes & 0x10)
+    *cluster = dir_entry->cluster;
+  else
+    ret = -ENOTDIR;
+  free(dir_entry);
+  return ret;
+}
 
+static void dir_iter_open(dir_iter_t *it, int cluster, int slot) {
+  it->cluster = cluster;
+  it->slot = slot;
+  it->n_slots = fat_info.BS.bytes_per_sector * fat_info.BS.sectors_per_cluster / sizeof(fat_dir_entry_t);
+  it->first = -1;
+  it->current = cluster;
+  it->entries = malloc(sizeof(fat_dir_entry_t) * it->n_slots);
+}
 
+static void dir_iter_close(dir_iter_t *it) {
+  free(it->entries);
 }
 
-static directory_entry_t * decode_sfn_entry(fat_dir_entry_t *fdir) {
-  char filename[256];
-	decode_short_file_name(filename, fdir);
-  directory_entry_t *dir_entry = malloc(sizeof(directory_entry_t));
-  fat_dir_entry_to_directory_entry(filename, fdir, dir_entry);
-  return dir_entry;
+// Device address of a slot held in the iterator buffer.
+static off_t dir_iter_addr(dir_iter_t *it, int slot) {
+  if (it->cluster < 0)
+    return fat_info.addr_root_dir + slot * sizeof(fat_dir_entry_t);
+  return fat_info.addr_data + (off_t)(it->current - 2) * fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector
+      + (slot - it->first) * sizeof(fat_dir_entry_t);
 }
 
-static int alloc_cluster(int n) {
-  if (n <= 0) {
-    return last_cluster();
+// Returns the entry at it->slot, reading the cluster that holds it if
+// needed. NULL past the end of the directory.
+static fat_dir_entry_t * dir_iter_slot(dir_iter_t *it) {
+  if (it->first >= 0 && it->slot >= it->first && it->slot < it->first + it->n_slots)
+    return &it->entries[it->slot - it->first];
+
+  int first = it->slot - it->slot % it->n_slots;
+  if (it->cluster < 0) {
+    if (it->slot >= fat_info.BS.root_entry_count)
+      return NULL;
+    int n = fat_info.BS.root_entry_count - first;
+    if (n > it->n_slots)
+      n = it->n_slots;
+    memset(it->entries, 0, sizeof(fat_dir_entry_t) * it->n_slots);
+    read_data(it->entries, sizeof(fat_dir_entry_t) * n, fat_info.addr_root_dir + first * sizeof(fat_dir_entry_t));
+  } else {
+    int next;
+    int c;
+    if (it->first >= 0 && first == it->first + it->n_slots) {
+      next = fat_info.file_alloc_table[it->current];
+    } else {
+      next = it->cluster;
+      for (c = 0; c < first / it->n_slots && !is_last_cluster(next); c++)
+        next = fat_info.file_alloc_table[next];
+    }
+    if (is_last_cluster(next) || next < 2)
+      return NULL;
+    it->current = next;
+    read_data(it->entries, sizeof(fat_dir_entry_t) * it->n_slots, fat_info.addr_data + (off_t)(next - 2) * fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector);
   }
-  int next = alloc_cluster(n - 1);
-  int i;
-  for (i = 0; i < fat_info.total_data_clusters; i++) {
-    if (fat_info.file_alloc_table[i] == 0) {
-      fat_info.file_alloc_table[i] = next;
-			write_fat_entry(i);
-      return i;
+  it->first = first;
+  return &it->entries[it->slot - first];
+}
+
+// Decodes the next entry, long name included, one cluster at a time.
+// it->slot is left on the slot following the entry, so it can be handed out
+// as a readdir offset. Returns 1 at the end of the directory.
+static int dir_iter_next(dir_iter_t *it, directory_entry_t *entry) {
+  char filename[LFN_NAME_MAX];
+  uint16_t units[LFN_MAX_ENTRIES * 13];
+  int lfn = 0;
+  fat_dir_entry_t *fdir;
+
+  while ((fdir = dir_iter_slot(it)) != NULL) {
+    if (fdir->utf8_short_name[0] == 0)
+      return 1;
+    it->slot++;
+    if ((unsigned char)fdir->utf8_short_name[0] == 0xE5) {
+      lfn = 0;
+      continue;
     }
+    if (fdir->file_attributes == 0x0F) {
+      lfn_entry_t *lfn_entry = (lfn_entry_t*) fdir;
+      int seq = lfn_entry->seq_number & 0x1F;
+      if (seq < 1 || seq > LFN_MAX_ENTRIES)
+        continue;
+      if (lfn_entry->seq_number & 0x40)
+        lfn = seq;
+      lfn_entry_units(units + (seq - 1) * 13, lfn_entry);
+      continue;
+    }
+    if (lfn)
+      utf16_to_utf8(units, lfn * 13, filename, sizeof(filename));
+    else
+      decode_short_file_name(filename, fdir);
+    fat_dir_entry_to_directory_entry(filename, fdir, entry);
+    entry->next = NULL;
+    return 0;
   }
-  return -1;
+  return 1;
+}
+
+static void init_dir_cluster(int cluster) {
+  int n_dir_entries = fat_info.BS.bytes_per_sector * fat_info.BS.sectors_per_cluster / sizeof(fat_dir_entry_t);
+  fat_dir_entry_t * dir_entries = calloc(n_dir_entries, sizeof(fat_dir_entry_t));
+ 
+  write_data(dir_entries, sizeof(fat_dir_entry_t) * n_dir_entries, fat_info.addr_data + (cluster - 2) * fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector);
+	free(dir_entries);
 }
 
+static off_t dir_slot_addr(dir_slots_t *slots, int slot) {
+  if (slots->cluster < 0)
+    return fat_info.addr_root_dir + slot * sizeof(fat_dir_entry_t);
 
-static int updatedate_dir_entry(int cluster, char * filename, time_t accessdate, time_t modifdate) {
-  directory_entry_t *dir_entry;
-  int n_clusters = 0;
+  int n_dir_entries = fat_info.BS.bytes_per_sector * fat_info.BS.sectors_per_cluster / sizeof(fat_dir_entry_t);
+  return fat_info.addr_data + (off_t)(slots->clusters[slot / n_dir_entries] - 2) * fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector
+      + (slot % n_dir_entries) * sizeof(fat_dir_entry_t);
+}
 
-  if (cluster > 0) {
+static void free_dir_slots(dir_slots_t *slots) {
+  sfn_set_free(slots);
+  free(slots->path);
+  free(slots->clusters);
+  free(slots->used);
+  free(slots);
+}
+
+// Reads the directory once and records which slots are in use.
+static dir_slots_t * load_dir_slots(const char *path, int cluster) {
+  dir_slots_t *slots = calloc(1, sizeof(dir_slots_t));
+  slots->path = strdup(path);
+  slots->cluster = cluster;
+
+  fat_dir_entry_t *entries;
+  if (cluster < 0) {
+    slots->n_slots = fat_info.BS.root_entry_count;
+    entries = malloc(sizeof(fat_dir_entry_t) * slots->n_slots);
+    read_data(entries, sizeof(fat_dir_entry_t) * slots->n_slots, fat_info.addr_root_dir);
+  } else {
+    int n_dir_entries = fat_info.BS.bytes_per_sector * fat_info.BS.sectors_per_cluster / sizeof(fat_dir_entry_t);
     int next = cluster;
     while (!is_last_cluster(next)) {
       next = fat_info.file_alloc_table[next];
-      n_clusters++;
+      slots->n_clusters++;
     }
-  
-    int n_dir_entries = fat_info.BS.bytes_per_sector * fat_info.BS.sectors_per_cluster / sizeof(fat_dir_entry_t);
-    fat_dir_entry_t * fdir = malloc(n_dir_entries * sizeof(fat_dir_entry_t) * n_clusters);
-  
+    slots->clusters = malloc(sizeof(uint32_t) * slots->n_clusters);
+    slots->n_slots = slots->n_clusters * n_dir_entries;
+    entries = malloc(sizeof(fat_dir_entry_t) * slots->n_slots);
+
     int c = 0;
     next = cluster;
     while (!is_last_cluster(next)) {
-      read_data(fdir + c * n_dir_entries, n_dir_entries * sizeof(fat_dir_entry_t), fat_info.addr_data + (next - 2) * fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector);
+      slots->clusters[c] = next;
+      read_data(entries + c * n_dir_entries, n_dir_entries * sizeof(fat_dir_entry_t), fat_info.addr_data + (next - 2) * fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector);
       next = fat_info.file_alloc_table[next];
       c++;
     }
-  
-    int i;
-    for (i = 0; i < n_dir_entries * n_clusters && fdir[i].utf8_short_name[0]; i++) {
-      if ((unsigned char)fdir[i].utf8_short_name[0] != 0xE5) {
-        if (fdir[i].file_attributes == 0x0F && ((lfn_entry_t*) &fdir[i])->seq_number & 0x40) {
-          dir_entry = decode_lfn_entry((lfn_entry_t*) &fdir[i]);
-          uint8_t seq = ((lfn_entry_t*) &fdir[i])->seq_number - 0x40;
-          i += seq;
-        } else {
-          dir_entry = decode_sfn_entry(&fdir[i]);
-        }
-  
-        if (strcmp(filename, dir_entry->name) == 0) {
-          next = cluster;
-          while (i >= n_dir_entries) {
-            i -= n_dir_entries;
-            next = fat_info.file_alloc_table[next];
-          }
-          convert_time_t_to_datetime_fat(accessdate, NULL, &(fdir[i].last_access_date));
-          convert_time_t_to_datetime_fat(modifdate, &(fdir[i].last_modif_time), &(fdir[i].last_modif_date));
-          write_data(&fdir[i], sizeof(fat_dir_entry_t), fat_info.addr_data + (next - 2) * fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector + i * sizeof(fat_dir_entry_t));
-					free(fdir);
-          return 0;
-        }
-        free(dir_entry);
-      }
+  }
+
+  slots->used = calloc(slots->n_slots, 1);
+  int i;
+  for (i = 0; i < slots->n_slots && entries[i].utf8_short_name[0]; i++) {
+    if ((unsigned char)entries[i].utf8_short_name[0] == 0xE5) {
+      slots->holes++;
+    } else {
+      slots->used[i] = 1;
+      if (entries[i].file_attributes != 0x0F)
+        sfn_set_add(slots, entries[i].utf8_short_name);
     }
-  } else {
-    fat_dir_entry_t *fdir = malloc(sizeof(fat_dir_entry_t) * fat_info.BS.root_entry_count);
-    read_data(fdir, sizeof(fat_dir_entry_t) * fat_info.BS.root_entry_count, fat_info.addr_root_dir);
- 
-    int i;
-    for (i = 0; i < fat_info.BS.root_entry_count && fdir[i].utf8_short_name[0]; i++) {
-      if ((unsigned char)fdir[i].utf8_short_name[0] != 0xE5) {
-        if (fdir[i].file_attributes == 0x0F && ((lfn_entry_t*) &fdir[i])->seq_number & 0x40) {
-          dir_entry = decode_lfn_entry((lfn_entry_t*) &fdir[i]);
-          uint8_t seq = ((lfn_entry_t*) &fdir[i])->seq_number - 0x40;
-          i += seq;
-        } else {
-          dir_entry = decode_sfn_entry(&fdir[i]);
-        }
-  
-        if (strcmp(filename, dir_entry->name) == 0) {
-          convert_time_t_to_datetime_fat(accessdate, NULL, &(fdir[i].last_access_date));
-          convert_time_t_to_datetime_fat(modifdate, &(fdir[i].last_modif_time), &(fdir[i].last_modif_date));
-          write_data(&fdir[i], sizeof(fat_dir_entry_t), fat_info.addr_root_dir + i * sizeof(fat_dir_entry_t));
-					free(fdir);
-  
-          return 0;
+  }
+  slots->end = i;
+  slots->holes_scanned = -1;
+
+  free(entries);
+  return slots;
+}
+
+// Returns the slot map of the directory at path, loading it if needed
+// (called with dir_slots_lock held).
+static dir_slots_t * get_dir_slots(const char *path) {
+  dir_slots_t **link = &dir_slots_cache;
+  int n = 0;
+  if (strcmp(path, "/") == 0)
+    path = "";
+
+  // Spellings of the same path share one map.
+  while (*link) {
+    dir_slots_t *slots = *link;
+    if (name_equal(slots->path, path)) {
+      *link = slots->next;
+      slots->next = dir_slots_cache;
+      dir_slots_cache = slots;
+      return slots;
+    }
+    if (++n == DIR_SLOTS_CACHE_SIZE && slots->next) {
+      free_dir_slots(slots->next);
+      slots->next = NULL;
+    }
+    link = &slots->next;
+  }
+
+  directory_t *dir = open_dir_from_path(path);
+  if (dir == NULL)
+    return NULL;
+  dir_slots_t *slots = load_dir_slots(path, dir->cluster);
+  close_dir(dir);
+
+  slots->next = dir_slots_cache;
+  dir_slots_cache = slots;
+  return slots;
+}
+
+static void release_dir_slots(int cluster, int first, int count, const char *sfn) {
+  pthread_mutex_lock(&dir_slots_lock);
+  dir_slots_t *slots;
+  for (slots = dir_slots_cache; slots; slots = slots->next) {
+    if (slots->cluster == cluster) {
+      sfn_set_remove(slots, sfn);
+      int i;
+      for (i = first; i < first + count && i < slots->end; i++) {
+        if (slots->used[i]) {
+          slots->used[i] = 0;
+          slots->holes++;
         }
-        free(dir_entry);
       }
+      break;
     }
   }
+  pthread_mutex_unlock(&dir_slots_lock);
+}
 
+// Drops the slot maps of path and of everything below it, after the
+// directory moved or disappeared.
+static void forget_dir_slots(const char *path) {
+  dir_slots_t **link = &dir_slots_cache;
+
+  pthread_mutex_lock(&dir_slots_lock);
+  while (*link) {
+    dir_slots_t *slots = *link;
+    const char *rest = fold_prefix(slots->path, path);
+    if (rest != NULL && (*rest == '\0' || *rest == '/')) {
+      *link = slots->next;
+      free_dir_slots(slots);
+    } else {
+      link = &slots->next;
+    }
+  }
+  pthread_mutex_unlock(&dir_slots_lock);
+}
 
-  return 1;
+// Adds a cluster at the end of the directory chain.
+static int grow_dir_slots(dir_slots_t *slots) {
+  if (slots->cluster < 0)
+    return 1;
+
+  int n_dir_entries = fat_info.BS.bytes_per_sector * fat_info.BS.sectors_per_cluster / sizeof(fat_dir_entry_t);
+  int newcluster = alloc_cluster(1);
+  if (newcluster < 0)
+    return 1;
+  init_dir_cluster(newcluster);
+  set_fat_entry(slots->clusters[slots->n_clusters - 1], newcluster);
+  fprintf(debug, "new cluster : %d\n", newcluster);
+  fflush(debug);
+
+  slots->clusters = realloc(slots->clusters, sizeof(uint32_t) * (slots->n_clusters + 1));
+  slots->clusters[slots->n_clusters++] = newcluster;
+  slots->used = realloc(slots->used, slots->n_slots + n_dir_entries);
+  memset(slots->used + slots->n_slots, 0, n_dir_entries);
+  slots->n_slots += n_dir_entries;
+  return 0;
 }
 
-static int delete_dir_entry(fat_dir_entry_t *fdir, const char *name, int n) {
-	fprintf(debug, "delete_dir_entry %s %d\n", name, n);
-	fflush(debug);
-  char filename[256];
+// Finds n consecutive free slots. The free tail is used first, deleted
+// slots are only searched once the tail is exhausted, and only if some were
+// freed since the last unsuccessful search.
+static int reserve_dir_slots(dir_slots_t *slots, int n) {
   int i;
+  if (slots->end + n > slots->n_slots && slots->holes >= n && slots->holes != slots->holes_scanned) {
+    int consecutif = 0;
+    for (i = 0; i < slots->end; i++) {
+      consecutif = slots->used[i] ? 0 : consecutif + 1;
+      if (consecutif == n) {
+        int first = i - n + 1;
+        memset(slots->used + first, 1, n);
+        slots->holes -= n;
+        return first;
+      }
+    }
+    slots->holes_scanned = slots->holes;
+  }
 
-  for (i = 0; i < n && fdir[i].utf8_short_name[0]; i++) {
-		fprintf(debug, "> %s\n", fdir[i].utf8_short_name);
-    if ((unsigned char)fdir[i].utf8_short_name[0] != 0xE5) {
-      if (fdir[i].file_attributes == 0x0F && ((lfn_entry_t*) &fdir[i])->seq_number & 0x40) {
+  while (slots->end + n > slots->n_slots) {
+    if (grow_dir_slots(slots) != 0)
+      return -1;
+  }
 
-			  int j;
-			  uint8_t i_filename = 0;
-			  uint8_t seq = ((lfn_entry_t*) &fdir[i])->seq_number - 0x40;
-			  for (j = seq-1; j >= 0; j--) {
-			    decode_long_file_name(filename + i_filename, (lfn_entry_t*) &fdir[i+j]);
-			    i_filename += 13;
-			  }
+  int first = slots->end;
+  memset(slots->used + first, 1, n);
+  slots->end += n;
+  return first;
+}
 
-				fprintf(debug, "cmp %s %s\n", filename, name);
-				fflush(debug);
-				if (strcmp(filename, name) == 0) {
-					for (j = seq; j >= 0; j--) {
-						fdir[i+j].utf8_short_name[0] = 0xE5;
-					}
-					return 0;
-				}
-        i += seq;
-      } else {
-        decode_short_file_name(filename, &fdir[i]);
-				if (strcmp(filename, name) == 0) {
-					fdir[i].utf8_short_name[0] = 0xE5;
-					return 0;
-				}
-      }
+// Writes n entries starting at slot first, one write per run of physically
+// contiguous slots.
+static void write_dir_slots(dir_slots_t *slots, int first, fat_dir_entry_t *fentry, int n) {
+  int i = 0;
+  while (i < n) {
+    off_t addr = dir_slot_addr(slots, first + i);
+    int run = 1;
+    while (i + run < n && dir_slot_addr(slots, first + i + run) == addr + run * sizeof(fat_dir_entry_t))
+      run++;
+    write_data(&fentry[i], sizeof(fat_dir_entry_t) * run, addr);
+    i += run;
+  }
+}
+
+static void invalidate_dir_cache() {
+  pthread_mutex_lock(&dir_cache.lock);
+  close_dir(dir_cache.dir);
+  dir_cache.dir = NULL;
+  dir_cache.path[0] = '\0';
+  dir_cache.generation++;
+  pthread_mutex_unlock(&dir_cache.lock);
+}
+
+// Adds filename to the directory at path. fentry holds everything but the
+// name : the short name is generated here and the long name entries are
+// written in front of it. Returns -ENOSPC if the directory is full,
+// -EINVAL or -ENAMETOOLONG if the name cannot be stored.
+static int add_fat_dir_entry(char * path, const char * filename, fat_dir_entry_t *fentry) {
+  uint16_t units[LFN_MAX_UNITS];
+  int len = utf8_to_utf16(filename, units, LFN_MAX_UNITS);
+  if (len < 0)
+    return len;
+  if (len == 0)
+    return -EINVAL;
+
+  int ret = -ENOSPC;
+  int n_entries = 1 + ((len - 1) / 13);
+  lfn_entry_t * long_file_name = malloc(sizeof(lfn_entry_t) * (n_entries + 1));
+
+  pthread_mutex_lock(&dir_slots_lock);
+  dir_slots_t *slots = get_dir_slots(path);
+  if (slots) {
+    generate_short_name(slots, filename, fentry->utf8_short_name);
+    encode_long_file_name(units, len, long_file_name, n_entries, lfn_checksum(fentry->utf8_short_name));
+    memcpy(&long_file_name[n_entries], fentry, sizeof(fat_dir_entry_t));
+
+    int first = reserve_dir_slots(slots, n_entries + 1);
+    if (first >= 0) {
+      write_dir_slots(slots, first, (fat_dir_entry_t*)long_file_name, n_entries + 1);
+      sfn_set_add(slots, fentry->utf8_short_name);
+      ret = 0;
     }
   }
-	return 1;
+  pthread_mutex_unlock(&dir_slots_lock);
+
+  // getattr only caches a miss under dir_cache.lock, against a listing of
+  // the current generation. Once the generation moves on, no scan of the old
+  // listing can put the name back.
+  if (ret == 0) {
+    invalidate_dir_cache();
+    neg_cache_remove(path, filename);
+  }
+
+  free(long_file_name);
+  return ret;
 }
 
-static void read_dir_entries(fat_dir_entry_t *fdir, directory_t *dir, int n) {
-	fprintf(debug, "read_dir_entries\n");
-	fflush(debug);
-  int i;
-  for (i = 0; i < n && fdir[i].utf8_short_name[0]; i++) {
-    directory_entry_t * dir_entry;
+static void attributes_to_stat(uint8_t attributes, uint32_t size, time_t atime, time_t mtime, time_t ctime, struct stat *stbuf) {
+  memset(stbuf, 0, sizeof(struct stat));
+  stbuf->st_nlink = 2; // XXX
+  stbuf->st_mode = 0755;
+  if (attributes & 0x01) { // Read Only
+    stbuf->st_mode &= ~0111;
+  }
+  if (attributes & 0x10) { // Dir.
+    stbuf->st_mode |= S_IFDIR;
+  } else {
+    stbuf->st_mode |= S_IFREG;
+  }
+  stbuf->st_atime = atime;
+  stbuf->st_mtime = mtime;
+  stbuf->st_ctime = ctime;
+  stbuf->st_size = size;
+}
 
-    if ((unsigned char)fdir[i].utf8_short_name[0] != 0xE5) {
-      if (fdir[i].file_attributes == 0x0F && ((lfn_entry_t*) &fdir[i])->seq_number & 0x40) {
-        dir_entry = decode_lfn_entry((lfn_entry_t*) &fdir[i]);
-        uint8_t seq = ((lfn_entry_t*) &fdir[i])->seq_number - 0x40;
-        i += seq;
+static void directory_entry_to_stat(directory_entry_t *dir_entry, struct stat *stbuf) {
+  attributes_to_stat(dir_entry->attributes, dir_entry->size, dir_entry->access_time,
+                     dir_entry->modification_time, dir_entry->creation_time, stbuf);
+}
+
+// Hand a freshly decoded directory over to the cache (called with the lock held).
+static void store_dir_cache(const char *path, directory_t *dir) {
+  if (strlen(path) >= sizeof(dir_cache.path)) {
+    close_dir(dir);
+    return;
+  }
+  close_dir(dir_cache.dir);
+  strcpy(dir_cache.path, strcmp(path, "/") == 0 ? "" : path);
+  dir_cache.dir = dir;
+}
+
+// Returns the cached directory for path, or NULL (called with the lock held).
+static directory_t * lookup_dir_cache(const char *path) {
+  if (strcmp(path, "/") == 0)
+    path = "";
+  if (dir_cache.dir && strcmp(dir_cache.path, path) == 0)
+    return dir_cache.dir;
+  return NULL;
+}
+
+// Points the entry of name in the directory at dir_cluster to new_cluster,
+// if it still starts at old_cluster (called with relocate_lock held).
+static int relocate_dir_entry(int dir_cluster, const char *name, uint32_t old_cluster, uint32_t new_cluster) {
+  dir_iter_t it;
+  directory_entry_t entry;
+  int ret = 1;
+
+  uint32_t hash = name_hash(name);
+  dir_iter_open(&it, dir_cluster, 0);
+  while (dir_iter_next(&it, &entry) == 0) {
+    if (!entry_matches(&entry, name, hash))
+      continue;
+    int slot = it.slot - 1;
+    fat_dir_entry_t *fdir = &it.entries[slot - it.first];
+    if (entry_cluster(fdir) == old_cluster) {
+      set_entry_cluster(fdir, new_cluster);
+      write_data(fdir, sizeof(fat_dir_entry_t), dir_iter_addr(&it, slot));
+      ret = 0;
+    }
+    break;
+  }
+  dir_iter_close(&it);
+  return ret;
+}
+
+// Sets the size and the first cluster of the entry of name in the directory
+// at dir_cluster, if it still starts at old_cluster (called with the file
+// lock held).
+static int set_dir_entry_size(int dir_cluster, const char *name, uint32_t old_cluster, uint32_t cluster, uint32_t size) {
+  dir_iter_t it;
+  directory_entry_t entry;
+  int ret = 1;
+
+  uint32_t hash = name_hash(name);
+  dir_iter_open(&it, dir_cluster, 0);
+  while (dir_iter_next(&it, &entry) == 0) {
+    if (!entry_matches(&entry, name, hash))
+      continue;
+    int slot = it.slot - 1;
+    fat_dir_entry_t *fdir = &it.entries[slot - it.first];
+    if (entry_cluster(fdir) == old_cluster) {
+      set_entry_cluster(fdir, cluster);
+      fdir->file_size = size;
+      convert_time_t_to_datetime_fat(time(NULL), &(fdir->last_modif_time), &(fdir->last_modif_date));
+      write_data(fdir, sizeof(fat_dir_entry_t), dir_iter_addr(&it, slot));
+      ret = 0;
+    }
+    break;
+  }
+  dir_iter_close(&it);
+  return ret;
+}
+
+// Returns the first cluster of n free contiguous clusters and allocates them
+// as one chain, 0 if there is no such run. The table is scanned without the
+// locks, only the groups covering a candidate run are locked to check it
+// again and take it : writers elsewhere are not held up by the scan.
+static uint32_t alloc_contiguous(uint32_t n) {
+  uint32_t end = fat_info.total_data_clusters + 2;
+  uint32_t first = 0, run, i = 2, c, g;
+
+  while (i < end) {
+    for (run = 0; i < end && run < n; i++) {
+      if (fat_info.file_alloc_table[i] == 0) {
+        if (run++ == 0)
+          first = i;
       } else {
-        dir_entry = decode_sfn_entry(&fdir[i]);
+        run = 0;
       }
-      dir_entry->next = dir->entries;
-      dir->entries = dir_entry;
-      dir->total_entries++;
     }
+    if (run < n)
+      return 0;
+
+    uint32_t first_group = group_of(first) - alloc_groups;
+    uint32_t last_group = group_of(first + n - 1) - alloc_groups;
+    for (g = first_group; g <= last_group; g++)
+      pthread_mutex_lock(&alloc_groups[g].lock);
+    for (c = first; c < first + n && fat_info.file_alloc_table[c] == 0; c++)
+      ;
+    if (c == first + n) {
+      for (c = first; c < first + n; c++)
+        update_fat_entry(c, c + 1 == first + n ? (uint32_t) last_cluster() : c + 1);
+      uint32_t first_sector = fat_entry_offset(first) / fat_info.BS.bytes_per_sector;
+      // Up to the last byte of the last entry, the sectors past it may belong
+      // to a group not locked here.
+      uint32_t last_byte = fat_entry_offset(first + n - 1) + (fat_info.fat_type == FAT32 ? 3 : 1);
+      uint32_t last_sector = last_byte / fat_info.BS.bytes_per_sector;
+      write_fat_sectors(first_sector, last_sector - first_sector + 1);
+    }
+    for (g = last_group + 1; g > first_group; g--)
+      pthread_mutex_unlock(&alloc_groups[g - 1].lock);
+    if (c == first + n)
+      return first;
+    // Taken meanwhile : go on past the cluster in the way.
+    i = c + 1;
   }
+  return 0;
 }
 
-static void delete_file_dir(int cluster, const char * name) {
-  int n_dir_entries = fat_info.BS.bytes_per_sector * fat_info.BS.sectors_per_cluster / sizeof(fat_dir_entry_t);
-	if (cluster >= 0) {
+static uint32_t chain_length(uint32_t cluster, uint32_t *runs) {
+  uint32_t n = 0, c, prev = 0;
 
-	  int n_clusters = 0;
-	  int next = cluster;
-	  while (!is_last_cluster(next)) {
-	    next = fat_info.file_alloc_table[next];
-	    n_clusters++;
-	  }
-	
-	  fat_dir_entry_t * sub_dir = malloc(n_dir_entries * sizeof(fat_dir_entry_t) * n_clusters);
-	
-	  int c = 0;
-	  next = cluster;
-	  while (!is_last_cluster(next)) {
-	    read_data(sub_dir + c * n_dir_entries, n_dir_entries * sizeof(fat_dir_entry_t), fat_info.addr_data + (next - 2) * fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector);
-	    next = fat_info.file_alloc_table[next];
-	    c++;
-	  }
-	
-		if (delete_dir_entry(sub_dir, name, n_dir_entries * n_clusters) == 0) {
-	
-			c = 0;
-			next = cluster;
-		  while (!is_last_cluster(next)) {
-				write_data(sub_dir + c * n_dir_entries, n_dir_entries * sizeof(fat_dir_entry_t), fat_info.addr_data + (next - 2) * fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector);
-		    next = fat_info.file_alloc_table[next];
-		    c++;
-			}
-	
-		} else {
-			fprintf(debug, "delete_file_dir failed\n");
-		}
-	
-	} else {
-    fat_dir_entry_t *root_dir = malloc(sizeof(fat_dir_entry_t) * fat_info.BS.root_entry_count);
-    read_data(root_dir, sizeof(fat_dir_entry_t) * fat_info.BS.root_entry_count, fat_info.addr_root_dir);
-		if (delete_dir_entry(root_dir, name, n_dir_entries) == 0) {
-			write_data(root_dir, sizeof(fat_dir_entry_t) * fat_info.BS.root_entry_count, fat_info.addr_root_dir);
-		} else {
-			fprintf(debug, "delete_file_dir failed\n");
-		}
-	}
+  *runs = 0;
+  for (c = cluster; is_used_cluster(c) && n <= fat_info.total_data_clusters; c = fat_info.file_alloc_table[c]) {
+    if (c != prev + 1)
+      (*runs)++;
+    prev = c;
+    n++;
+  }
+  return n;
 }
 
-static void open_dir(int cluster, directory_t *dir) {
-  int n_clusters = 0;
-  int next = cluster;
-  while (!is_last_cluster(next)) {
-    next = fat_info.file_alloc_table[next];
-    n_clusters++;
+// Copies a fragmented file into a contiguous run, then switches its entry
+// over. Writes to the file from the moment its chain is measured cancel the
+// move.
+static void defrag_file(int dir_cluster, directory_entry_t *entry) {
+  uint32_t cluster_size = fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector;
+  uint32_t n, runs, c;
+
+  pthread_rwlock_wrlock(&relocate_lock);
+  defrag.moving = entry->cluster;
+  defrag.moving_dirty = 0;
+  n = chain_length(entry->cluster, &runs);
+  pthread_rwlock_unlock(&relocate_lock);
+
+  uint32_t target = 0;
+  if (runs > 1) {
+    tx_begin();
+    target = alloc_contiguous(n);
+    tx_commit();
+  }
+  if (target == 0) {
+    pthread_rwlock_wrlock(&relocate_lock);
+    defrag.moving = 0;
+    pthread_rwlock_unlock(&relocate_lock);
+    return;
+  }
+
+  // Copy run by run.
+  uint8_t *buffer = malloc(cluster_size * 64);
+  uint32_t done = 0;
+  c = entry->cluster;
+  while (done < n) {
+    uint32_t start = c, len = 1;
+    while (len < 64 && done + len < n && fat_info.file_alloc_table[c] == c + 1) {
+      c++;
+      len++;
+    }
+    device->read(buffer, (size_t) len * cluster_size, fat_info.addr_data + (off_t)(start - 2) * cluster_size);
+    journal_revoke(fat_info.addr_data + (off_t)(target + done - 2) * cluster_size, (size_t) len * cluster_size);
+    device->write(buffer, (size_t) len * cluster_size, fat_info.addr_data + (off_t)(target + done - 2) * cluster_size);
+    done += len;
+    c = fat_info.file_alloc_table[c];
+
+    if (options.defrag_rate > 0)
+      usleep((useconds_t)((uint64_t) len * cluster_size * 1000000 / ((uint64_t) options.defrag_rate << 20)));
   }
+  device->flush();
+  free(buffer);
+
+  pthread_rwlock_wrlock(&relocate_lock);
+  int moved = !defrag.moving_dirty && chain_length(entry->cluster, &runs) == n &&
+              relocate_dir_entry(dir_cluster, entry->name, entry->cluster, target) == 0;
+  defrag.moving = 0;
+  pthread_rwlock_unlock(&relocate_lock);
+
+  if (moved) {
+    invalidate_dir_cache();
+    reclaim_chain(entry->cluster);
+  } else {
+    reclaim_chain(target);
+  }
+}
 
-  int n_dir_entries = fat_info.BS.bytes_per_sector * fat_info.BS.sectors_per_cluster / sizeof(fat_dir_entry_t);
-  fat_dir_entry_t * sub_dir = malloc(n_dir_entries * sizeof(fat_dir_entry_t) * n_clusters);
+static void defrag_dir(int dir_cluster, int depth) {
+  dir_iter_t it;
+  directory_entry_t entry;
+
+  dir_iter_open(&it, dir_cluster, 0);
+  while (defrag.running && dir_iter_next(&it, &entry) == 0) {
+    if (strcmp(entry.name, ".") == 0 || strcmp(entry.name, "..") == 0)
+      continue;
+    if (entry.attributes & 0x10) {
+      if (depth < 64 && is_used_cluster(entry.cluster))
+        defrag_dir(entry.cluster, depth + 1);
+    } else if (entry.size > 0 && is_used_cluster(entry.cluster)) {
+      defrag_file(dir_cluster, &entry);
+    }
+  }
+  dir_iter_close(&it);
+}
 
-  int c = 0;
-  next = cluster;
-  while (!is_last_cluster(next)) {
-    read_data(sub_dir + c * n_dir_entries, n_dir_entries * sizeof(fat_dir_entry_t), fat_info.addr_data + (next - 2) * fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector);
-    next = fat_info.file_alloc_table[next];
-    c++;
+static void * defrag_thread(void *arg) {
+  // Lowest CPU priority, idle I/O class.
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+  syscall(SYS_ioprio_set, 1, 0, 3 << 13);
+
+  pthread_mutex_lock(&defrag.lock);
+  while (defrag.running) {
+    pthread_mutex_unlock(&defrag.lock);
+    defrag_dir(fat_info.fat_type == FAT32 ? (int) fat_info.ext_BIOS_32->cluster_root_dir : -1, 0);
+
+    pthread_mutex_lock(&defrag.lock);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += DEFRAG_INTERVAL;
+    if (defrag.running)
+      pthread_cond_timedwait(&defrag.cond, &defrag.lock, &ts);
   }
+  pthread_mutex_unlock(&defrag.lock);
+  return NULL;
+}
 
-  dir->cluster = cluster;
-  dir->total_entries = 0;
-  dir->entries = NULL;
+static void start_defrag() {
+  if (!options.defrag)
+    return;
+  defrag.running = 1;
+  if (pthread_create(&defrag.thread, NULL, defrag_thread, NULL) != 0)
+    defrag.running = 0;
+}
 
-  read_dir_entries(sub_dir, dir, n_dir_entries * n_clusters);
+static void stop_defrag() {
+  if (!defrag.running)
+    return;
+  pthread_mutex_lock(&defrag.lock);
+  defrag.running = 0;
+  pthread_cond_signal(&defrag.cond);
+  pthread_mutex_unlock(&defrag.lock);
+  pthread_join(defrag.thread, NULL);
 }
 
-static directory_t * open_root_dir() {
-	fprintf(debug, "open_root_dir\n");
-	fflush(debug);
-  directory_t *dir = malloc(sizeof(directory_t));
+// Read-only serving (-o ro). The tree is walked once at mount into ro_index,
+// which is never modified afterwards : getattr, open, read and readdir are
+// answered from it without locks and without reading metadata.
+static ro_index_t ro_index;
 
-  if (fat_info.fat_type == FAT32) {
-    open_dir(fat_info.ext_BIOS_32->cluster_root_dir, dir);
-  } else {
-    fat_dir_entry_t *root_dir = malloc(sizeof(fat_dir_entry_t) * fat_info.BS.root_entry_count);
-  
-    read_data(root_dir, sizeof(fat_dir_entry_t) * fat_info.BS.root_entry_count, fat_info.addr_root_dir);
-  
-    dir->cluster = -1;
-    dir->total_entries = 0;
-    dir->entries = NULL;
-  
-    read_dir_entries(root_dir, dir, fat_info.BS.root_entry_count);
-  
-    free(root_dir);
+static uint32_t ro_add_string(const char *str, uint32_t *capacity) {
+  uint32_t len = strlen(str) + 1;
+  while (ro_index.strings_size + len > *capacity) {
+    *capacity = *capacity ? *capacity * 2 : 1 << 16;
+    ro_index.strings = realloc(ro_index.strings, *capacity);
   }
+  memcpy(ro_index.strings + ro_index.strings_size, str, len);
+  ro_index.strings_size += len;
+  return ro_index.strings_size - len;
+}
 
-  return dir;
+static ro_node_t * ro_node(uint32_t index) {
+  return &ro_index.nodes[index];
 }
 
-static int open_next_dir(directory_t * prev_dir, directory_t * next_dir, char * name) {
-  fprintf(debug, "open_next_dir, name = %s\n", name);
-	fprintf(debug, "open_next_dir, prev_dir->cluster = %d\n", prev_dir->cluster);
-  fflush(debug);
+static const char * ro_string(uint32_t offset) {
+  return ro_index.strings + offset;
+}
 
-  int next = 0;
+static ro_node_t * ro_lookup(const char *path) {
+  uint32_t hash = name_hash(path);
+  uint32_t mask = ro_index.n_buckets - 1;
+  uint32_t b;
+  for (b = hash & mask; ro_index.buckets[b]; b = (b + 1) & mask) {
+    ro_node_t *node = ro_node(ro_index.buckets[b] - 1);
+    if (node->hash == hash && name_equal(ro_string(node->path), path))
+      return node;
+  }
+  return NULL;
+}
 
-  directory_entry_t *dentry = prev_dir->entries;
-  while (dentry) {
-    if (strcmp(dentry->name, name) == 0) {
-      if ((dentry->attributes & 0x10) == 0x10) { //c'est bien un repe
-        next = dentry->cluster;
-        break;
-      } else {
-        return 2;
+static void ro_node_to_stat(ro_node_t *node, struct stat *stbuf) {
+  attributes_to_stat(node->attributes, node->size, node->access_time,
+                     node->modification_time, node->creation_time, stbuf);
+}
+
+// Walks the tree breadth first : the children of each directory are appended
+// as one run of nodes, the chain of each file as a list of extents.
+static void build_ro_index() {
+  uint32_t cluster_size = fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector;
+  uint32_t nodes_capacity = 1024, extents_capacity = 1024, strings_capacity = 0;
+  uint32_t *dir_clusters = malloc(sizeof(uint32_t) * nodes_capacity);
+  uint8_t *seen = calloc((fat_info.total_data_clusters + 2 + 7) / 8, 1);
+  uint32_t i;
+
+  ro_index.nodes = calloc(nodes_capacity, sizeof(ro_node_t));
+  ro_index.extents = malloc(sizeof(ro_extent_t) * extents_capacity);
+  ro_index.n_nodes = 1;
+  ro_index.nodes[0].path = ro_add_string("/", &strings_capacity);
+  ro_index.nodes[0].name = ro_index.nodes[0].path + 1;
+  ro_index.nodes[0].hash = name_hash("/");
+  ro_index.nodes[0].attributes = 0x10;
+
+  for (i = 0; i < ro_index.n_nodes; i++) {
+    if (!(ro_node(i)->attributes & 0x10))
+      continue;
+
+    directory_t *dir;
+    if (i == 0) {
+      dir = open_root_dir();
+    } else {
+      // A directory linked twice would be walked forever.
+      uint32_t c = dir_clusters[i];
+      if (!is_used_cluster(c) || c >= fat_info.total_data_clusters + 2 || (seen[c / 8] & (1 << (c % 8))))
+        continue;
+      seen[c / 8] |= 1 << (c % 8);
+      dir = malloc(sizeof(directory_t));
+      open_dir(c, dir);
+    }
+
+    ro_node(i)->first = ro_index.n_nodes;
+    directory_entry_t *entry;
+    for (entry = dir->entries; entry; entry = entry->next) {
+      if (strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0)
+        continue;
+      if (ro_index.n_nodes == nodes_capacity) {
+        nodes_capacity *= 2;
+        ro_index.nodes = realloc(ro_index.nodes, sizeof(ro_node_t) * nodes_capacity);
+        dir_clusters = realloc(dir_clusters, sizeof(uint32_t) * nodes_capacity);
+      }
+      uint32_t n = ro_index.n_nodes++;
+      ro_node_t *node = ro_node(n);
+      const char *parent_path = ro_string(ro_node(i)->path);
+      char *path = malloc(strlen(parent_path) + strlen(entry->name) + 2);
+      sprintf(path, "%s%s%s", parent_path, i == 0 ? "" : "/", entry->name);
+      memset(node, 0, sizeof(ro_node_t));
+      node->path = ro_add_string(path, &strings_capacity);
+      node->name = node->path + strlen(path) - strlen(entry->name);
+      node->hash = name_hash(path);
+      node->parent = i;
+      node->attributes = entry->attributes;
+      node->size = entry->size;
+      node->access_time = entry->access_time;
+      node->modification_time = entry->modification_time;
+      node->creation_time = entry->creation_time;
+      dir_clusters[n] = entry->cluster;
+      free(path);
+      ro_node(i)->count++;
+
+      if (entry->attributes & 0x10)
+        continue;
+      // Extents, no further than the size needs.
+      uint32_t need = (entry->size + cluster_size - 1) / cluster_size;
+      uint32_t c = entry->cluster, done = 0;
+      node->first = ro_index.n_extents;
+      while (done < need && is_used_cluster(c) && c < fat_info.total_data_clusters + 2) {
+        if (node->count > 0 && ro_index.extents[ro_index.n_extents - 1].cluster + ro_index.extents[ro_index.n_extents - 1].count == c) {
+          ro_index.extents[ro_index.n_extents - 1].count++;
+        } else {
+          if (ro_index.n_extents == extents_capacity) {
+            extents_capacity *= 2;
+            ro_index.extents = realloc(ro_index.extents, sizeof(ro_extent_t) * extents_capacity);
+          }
+          ro_index.extents[ro_index.n_extents].cluster = c;
+          ro_index.extents[ro_index.n_extents].count = 1;
+          ro_index.extents[ro_index.n_extents].offset = done;
+          ro_index.n_extents++;
+          node->count++;
+        }
+        done++;
+        c = fat_info.file_alloc_table[c];
       }
+      // A short chain : only what it holds can be read.
+      if ((uint64_t) done * cluster_size < node->size)
+        node->size = done * cluster_size;
     }
-    dentry = dentry->next;
+    close_dir(dir);
   }
-
-  if (next == 0) {
-    return 1;
+  free(dir_clusters);
+  free(seen);
+
+  for (ro_index.n_buckets = 16; ro_index.n_buckets < ro_index.n_nodes * 2; ro_index.n_buckets *= 2)
+    ;
+  ro_index.buckets = calloc(ro_index.n_buckets, sizeof(uint32_t));
+  for (i = 0; i < ro_index.n_nodes; i++) {
+    uint32_t b = ro_node(i)->hash & (ro_index.n_buckets - 1);
+    while (ro_index.buckets[b])
+      b = (b + 1) & (ro_index.n_buckets - 1);
+    ro_index.buckets[b] = i + 1;
   }
- 
-  open_dir(next, next_dir);
+  fprintf(stderr, "Read-only index : %u nodes, %u extents, %u bytes of names\n",
+          ro_index.n_nodes, ro_index.n_extents, ro_index.strings_size);
+}
+
+static int ro_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset) {
+  ro_node_t *dir = ro_lookup(path);
+  struct stat st;
+
+  if (dir == NULL)
+    return -ENOENT;
+  if (!(dir->attributes & 0x10))
+    return -ENOTDIR;
 
+  // Offsets : 1 and 2 for the dot entries, 3 + i for the i-th child.
+  if (offset < 1) {
+    ro_node_to_stat(dir, &st);
+    if (FAT_FILL_DIR(filler, buf, ".", &st, 1))
+      return 0;
+  }
+  if (offset < 2) {
+    ro_node_to_stat(ro_node(dir->parent), &st);
+    if (FAT_FILL_DIR(filler, buf, "..", &st, 2))
+      return 0;
+  }
+  uint32_t i;
+  for (i = offset > 2 ? offset - 2 : 0; i < dir->count; i++) {
+    ro_node_t *child = ro_node(dir->first + i);
+    ro_node_to_stat(child, &st);
+    if (FAT_FILL_DIR(filler, buf, ro_string(child->name), &st, i + 3))
+      break;
+  }
   return 0;
 }
 
-static void split_dir_filename(const char * path, char * dir, char * filename) {
-  char *p = strrchr(path, '/');
-  strcpy(filename, p+1);
-  for (; path < p; path++, dir++) {
-    *dir = *path;
-  } 
-  *dir = '\0';
+static int ro_read(ro_node_t *node, char *buf, size_t size, off_t offset) {
+  uint64_t cluster_size = fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector;
+
+  if (offset >= node->size)
+    return 0;
+  if (size + offset > node->size)
+    size = node->size - offset;
+
+  // The last extent starting at or before offset.
+  uint32_t target = offset / cluster_size;
+  uint32_t lo = node->first, hi = node->first + node->count;
+  while (hi - lo > 1) {
+    uint32_t mid = (lo + hi) / 2;
+    if (ro_index.extents[mid].offset <= target)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  size_t done = 0;
+  ro_extent_t *e;
+  for (e = &ro_index.extents[lo]; done < size && e < ro_index.extents + node->first + node->count; e++) {
+    uint64_t within = offset + done - e->offset * cluster_size;
+    size_t len = e->count * cluster_size - within;
+    if (len > size - done)
+      len = size - done;
+    ssize_t r = device->read(buf + done, len, cluster_addr(e->cluster) + within);
+    if (r < 0)
+      return done > 0 ? (int) done : -EIO;
+    done += r;
+    if ((size_t) r < len)
+      break;
+  }
+  return done;
 }
 
-static directory_t * open_dir_from_path(const char *path) {
-  fprintf(debug, "open_dir_from_path %s\n", path);
-  fflush(debug);
+// Sidecar index (-o index=FILE). A read-only mount saves the decoded FAT and
+// ro_index to FILE, and the next mount of the same image, recognized by its
+// volume id and a checksum of the FAT, maps it back with a single mmap
+// instead of decoding the FAT and walking the tree again. A read-write mount
+// may change directories without touching the FAT : it takes the FAT, and
+// removes the file.
+static uint64_t index_fat_checksum;
 
-  if (path[0] == '\0' || strcmp(path, "/") == 0)
-    return open_root_dir();
+static uint32_t volume_id() {
+  return fat_info.fat_type == FAT32 ? fat_info.ext_BIOS_32->volume_id : fat_info.ext_BIOS_16->volume_id;
+}
 
-  // Only absolute paths.
-  if (path[0] != '/')
-    return NULL;
+static int index_section_fits(uint64_t offset, uint64_t count, uint64_t item, uint64_t size) {
+  return offset % 8 == 0 && offset <= size && count <= (size - offset) / item;
+}
 
-  char buf[256];
-  int i = 1;
-  while (path[i] == '/')
-    i++;
+// The header matched, the contents are checked too : every link, string
+// offset and cluster number must stay inside its section, a corrupt file
+// must not crash lookups.
+static int index_is_valid(const index_header_t *header) {
+  const uint8_t *base = (const uint8_t*) header;
+  uint32_t end = fat_info.total_data_clusters + 2;
+  uint32_t i, used = 0;
+
+  if (!index_section_fits(header->fat_offset, end + 1, sizeof(unsigned int), header->size) ||
+      !index_section_fits(header->nodes_offset, header->n_nodes, sizeof(ro_node_t), header->size) ||
+      !index_section_fits(header->extents_offset, header->n_extents, sizeof(ro_extent_t), header->size) ||
+      !index_section_fits(header->strings_offset, header->strings_size, 1, header->size) ||
+      !index_section_fits(header->buckets_offset, header->n_buckets, sizeof(uint32_t), header->size))
+    return 0;
 
-  directory_t * dir = open_root_dir();
+  const unsigned int *fat = (const unsigned int*)(base + header->fat_offset);
+  for (i = 2; i < end; i++) {
+    if (is_used_cluster(fat[i]) && fat[i] >= end)
+      return 0;
+  }
+  if (header->n_nodes == 0)
+    return 1;
 
-  int j = 0;
-  do {
-    if (path[i] == '/' || path[i] == '\0') {
-      buf[j] = '\0';
+  const ro_node_t *nodes = (const ro_node_t*)(base + header->nodes_offset);
+  const ro_extent_t *extents = (const ro_extent_t*)(base + header->extents_offset);
+  const char *strings = (const char*)(base + header->strings_offset);
+  const uint32_t *buckets = (const uint32_t*)(base + header->buckets_offset);
+  if (header->strings_size == 0 || strings[header->strings_size - 1] != '\0' ||
+      header->n_buckets == 0 || (header->n_buckets & (header->n_buckets - 1)) != 0)
+    return 0;
+  for (i = 0; i < header->n_nodes; i++) {
+    const ro_node_t *node = &nodes[i];
+    uint32_t limit = node->attributes & 0x10 ? header->n_nodes : header->n_extents;
+    if (node->path >= header->strings_size || node->name >= header->strings_size ||
+        node->parent >= header->n_nodes || node->first > limit || node->count > limit - node->first)
+      return 0;
+  }
+  for (i = 0; i < header->n_extents; i++) {
+    if (extents[i].cluster < 2 || extents[i].cluster >= end || extents[i].count > end - extents[i].cluster)
+      return 0;
+  }
+  // Probing stops at an empty bucket : there must be one.
+  for (i = 0; i < header->n_buckets; i++) {
+    if (buckets[i] > header->n_nodes)
+      return 0;
+    used += buckets[i] != 0;
+  }
+  return used < header->n_buckets;
+}
 
-      if (j > 0 && open_next_dir(dir, dir, buf) != 0)
-        return NULL;
+static int load_index(uint64_t checksum) {
+  index_fat_checksum = checksum;
+  if (options.index == NULL)
+    return 0;
 
-      j = 0;
-    } else {
-      buf[j] = path[i];
-      j++;
-    }
-  } while (path[i++] != '\0');
+  int fd = open(options.index, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  struct stat st;
+  index_header_t *header = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(index_header_t))
+    header = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (!options.readonly)
+    unlink(options.index);
+  if (header == MAP_FAILED)
+    return 0;
 
-  return dir;
+  if (header->magic != INDEX_MAGIC || header->version != INDEX_VERSION ||
+      header->size != (uint64_t) st.st_size || header->volume_id != volume_id() ||
+      header->fat_checksum != checksum || header->total_data_clusters != fat_info.total_data_clusters) {
+    fprintf(stderr, "Index %s is stale, rebuilding.\n", options.index);
+    munmap(header, st.st_size);
+    return 0;
+  }
+  if (!index_is_valid(header)) {
+    fprintf(stderr, "Index %s is corrupt, rebuilding.\n", options.index);
+    munmap(header, st.st_size);
+    return 0;
+  }
+
+  uint8_t *base = (uint8_t*) header;
+  free(fat_info.file_alloc_table);
+  fat_info.file_alloc_table = (unsigned int*)(base + header->fat_offset);
+  if (options.readonly && header->n_nodes > 0) {
+    ro_index.nodes = (ro_node_t*)(base + header->nodes_offset);
+    ro_index.n_nodes = header->n_nodes;
+    ro_index.extents = (ro_extent_t*)(base + header->extents_offset);
+    ro_index.n_extents = header->n_extents;
+    ro_index.strings = (char*)(base + header->strings_offset);
+    ro_index.strings_size = header->strings_size;
+    ro_index.buckets = (uint32_t*)(base + header->buckets_offset);
+    ro_index.n_buckets = header->n_buckets;
+  }
+  fprintf(stderr, "Index loaded from %s : %u nodes, %u extents\n", options.index, header->n_nodes, header->n_extents);
+  return 1;
 }
 
-static directory_entry_t * open_file_from_path(const char *path) {
-  char * dir = malloc(strlen(path));
-  char filename[256];
-  split_dir_filename(path, dir, filename);
+static void write_index_section(int fd, const void *data, uint64_t size, uint64_t *offset) {
+  static const uint8_t pad[8];
+  uint64_t aligned = (*offset + 7) & ~7ull;
+  if (aligned > *offset && write(fd, pad, aligned - *offset) < 0)
+    return;
+  if (size > 0 && write(fd, data, size) < 0)
+    return;
+  *offset = aligned + size;
+}
 
-  directory_t * directory = open_dir_from_path(dir);
-  free(dir);
+// Written to a temporary file first, then renamed : a mount never sees half
+// an index.
+static void save_index() {
+  if (options.index == NULL)
+    return;
+
+  char *tmp = malloc(strlen(options.index) + 5);
+  sprintf(tmp, "%s.tmp", options.index);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot write index %s\n", tmp);
+    free(tmp);
+    return;
+  }
 
-  directory_entry_t *dir_entry = directory->entries;
-  while (dir_entry) {
-    if (strcmp(dir_entry->name, filename) == 0) {
-      free(directory);
-      // TODO: free de la liste chainée.
-      return dir_entry;
-    }
-    dir_entry = dir_entry->next;
+  index_header_t header;
+  uint64_t offset = sizeof(header);
+  memset(&header, 0, sizeof(header));
+  header.magic = INDEX_MAGIC;
+  header.version = INDEX_VERSION;
+  header.volume_id = volume_id();
+  header.total_data_clusters = fat_info.total_data_clusters;
+  header.fat_checksum = index_fat_checksum;
+  header.n_nodes = ro_index.n_nodes;
+  header.n_extents = ro_index.n_extents;
+  header.strings_size = ro_index.strings_size;
+  header.n_buckets = ro_index.n_buckets;
+
+  lseek(fd, offset, SEEK_SET);
+  header.fat_offset = (offset + 7) & ~7ull;
+  write_index_section(fd, fat_info.file_alloc_table, (uint64_t)(fat_info.total_data_clusters + 3) * sizeof(unsigned int), &offset);
+  header.nodes_offset = (offset + 7) & ~7ull;
+  write_index_section(fd, ro_index.nodes, (uint64_t) ro_index.n_nodes * sizeof(ro_node_t), &offset);
+  header.extents_offset = (offset + 7) & ~7ull;
+  write_index_section(fd, ro_index.extents, (uint64_t) ro_index.n_extents * sizeof(ro_extent_t), &offset);
+  header.strings_offset = (offset + 7) & ~7ull;
+  write_index_section(fd, ro_index.strings, ro_index.strings_size, &offset);
+  header.buckets_offset = (offset + 7) & ~7ull;
+  write_index_section(fd, ro_index.buckets, (uint64_t) ro_index.n_buckets * sizeof(uint32_t), &offset);
+  header.size = offset;
+
+  int ok = pwrite(fd, &header, sizeof(header), 0) == sizeof(header) && lseek(fd, 0, SEEK_END) == (off_t) offset;
+  ok = fsync(fd) == 0 && ok;
+  close(fd);
+  if (ok && rename(tmp, options.index) == 0) {
+    fprintf(stderr, "Index saved to %s\n", options.index);
+  } else {
+    fprintf(stderr, "Cannot write index %s\n", options.index);
+    unlink(tmp);
   }
+  free(tmp);
+}
 
-  free(directory);
-  // TODO: free de la liste chainée.
-  
-  return NULL;
+// Operation trace (-o trace=FILE). Every call through traced_oper appends a
+// trace_record_t to a buffer, written out when full and at unmount.
+#define TRACE_BUFFER (1 << 20)
+static struct {
+  pthread_mutex_t lock;
+  int fd;
+  char *buffer;
+  size_t length;
+  uint64_t start;
+  int threads;
+} trace = { PTHREAD_MUTEX_INITIALIZER, -1 };
+
+static __thread int trace_thread;
+
+static uint64_t trace_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-static void init_dir_cluster(int cluster) {
-  int n_dir_entries = fat_info.BS.bytes_per_sector * fat_info.BS.sectors_per_cluster / sizeof(fat_dir_entry_t);
-  fat_dir_entry_t * dir_entries = calloc(n_dir_entries, sizeof(fat_dir_entry_t));
- 
-  write_data(dir_entries, sizeof(fat_dir_entry_t) * n_dir_entries, fat_info.addr_data + (cluster - 2) * fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector);
-	free(dir_entries);
+static void trace_write_buffer() {
+  size_t done = 0;
+  while (done < trace.length) {
+    ssize_t n = write(trace.fd, trace.buffer + done, trace.length - done);
+    if (n <= 0)
+      break;
+    done += n;
+  }
+  trace.length = 0;
 }
 
-static int add_fat_dir_entry(char * path, fat_dir_entry_t *fentry, int n) {
-  directory_t *dir = open_dir_from_path(path);
-  int next = dir->cluster;
-  if (next > 0) {
-    int n_clusters = 0;
-    while (!is_last_cluster(next)) {
-      next = fat_info.file_alloc_table[next];
-      n_clusters++;
-    }
-  
-    int n_dir_entries = fat_info.BS.bytes_per_sector * fat_info.BS.sectors_per_cluster / sizeof(fat_dir_entry_t);
-    fat_dir_entry_t * dir_entries = malloc(n_dir_entries * sizeof(fat_dir_entry_t) * n_clusters);
-  
-    int c = 0;
-    next = dir->cluster;
-    while (!is_last_cluster(next)) {
-      read_data(dir_entries + c * n_dir_entries, n_dir_entries * sizeof(fat_dir_entry_t), fat_info.addr_data + (next - 2) * fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector);
-      next = fat_info.file_alloc_table[next];
-      c++;
-    }
-  
-    int i;
-    int consecutif = 0;
-    for (i = 0; i < n_dir_entries * n_clusters; i++) {
-      if (dir_entries[i].utf8_short_name[0] == 0 || dir_entries[i].utf8_short_name[0] == 0xe5) {
-        consecutif++;
-        if (consecutif == n) {
-          next = dir->cluster;
-          int j;
-          for (j = 0; j < (i - n + 1) / n_dir_entries; j++)
-            next = fat_info.file_alloc_table[next];
-          for (j = 0; j < n; j++) {
-            int off = (i - n + j + 1) % n_dir_entries; // offset dans le cluster.
-            write_data(&fentry[j], sizeof(fat_dir_entry_t), fat_info.addr_data + (next - 2) * fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector + off * sizeof(fat_dir_entry_t));
-            if (off == n_dir_entries - 1) {
-              next = fat_info.file_alloc_table[next];
-            }
-          }
-          return 0;
-        }
-      } else {
-        consecutif = 0;
-      }
-    }
-    if (consecutif < n) {
-      int j;
-      int newcluster = alloc_cluster(1);
-      init_dir_cluster(newcluster);
-      next = dir->cluster;
-      while (!is_last_cluster(fat_info.file_alloc_table[next])) {
-        next = fat_info.file_alloc_table[next];
-      }
-      fat_info.file_alloc_table[next] = newcluster;
-      fprintf(debug, "new cluster : %d %x\n", newcluster, fat_info.addr_data + (newcluster - 2) * fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector);
-      fflush(debug);
-  
-      for (j = 0; j < consecutif; j++) {
-        int off = n_dir_entries - consecutif + j;
-        write_data(&fentry[j], sizeof(fat_dir_entry_t), fat_info.addr_data + (next - 2) * fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector + off * sizeof(fat_dir_entry_t));
-      }
-      for (j = consecutif; j < n; j++) {
-        int off = n_dir_entries - consecutif + j;
-        write_data(&fentry[j], sizeof(fat_dir_entry_t), fat_info.addr_data + (newcluster - 2) * fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector + off * sizeof(fat_dir_entry_t));
-      }
-      return 0;
-    }
-  } else if (fat_info.fat_type != FAT32) {
-    int i;
-    int consecutif = 0;
-    fat_dir_entry_t *root_dir = malloc(sizeof(fat_dir_entry_t) * fat_info.BS.root_entry_count);
-    read_data(root_dir, sizeof(fat_dir_entry_t) * fat_info.BS.root_entry_count, fat_info.addr_root_dir);
+static void trace_record(trace_op_t op, const char *path, const char *to, uint32_t mode,
+                         uint64_t offset, uint32_t size, int result, uint64_t start) {
+  trace_record_t record;
+  uint64_t end = trace_now();
+
+  if (trace_thread == 0)
+    trace_thread = __atomic_add_fetch(&trace.threads, 1, __ATOMIC_RELAXED);
+  memset(&record, 0, sizeof(record));
+  record.op = op;
+  record.thread = trace_thread;
+  record.path_length = path ? strlen(path) : 0;
+  record.to_length = to ? strlen(to) : 0;
+  record.mode = mode;
+  record.size = size;
+  record.offset = offset;
+  record.start = start - trace.start;
+  record.duration = end - start > UINT32_MAX ? UINT32_MAX : end - start;
+  record.result = result;
+
+  pthread_mutex_lock(&trace.lock);
+  if (trace.length + sizeof(record) + record.path_length + record.to_length > TRACE_BUFFER)
+    trace_write_buffer();
+  memcpy(trace.buffer + trace.length, &record, sizeof(record));
+  trace.length += sizeof(record);
+  memcpy(trace.buffer + trace.length, path, record.path_length);
+  trace.length += record.path_length;
+  memcpy(trace.buffer + trace.length, to, record.to_length);
+  trace.length += record.to_length;
+  pthread_mutex_unlock(&trace.lock);
+}
 
-    for (i = 0; i < fat_info.BS.root_entry_count; i++) {
-      if (root_dir[i].utf8_short_name[0] == 0 || root_dir[i].utf8_short_name[0] == 0xe5) {
-        consecutif++;
-        if (consecutif == n) {
-          write_data(fentry, sizeof(fat_dir_entry_t) * n, fat_info.addr_root_dir + (i - n + 1) * sizeof(fat_dir_entry_t));
-          return 0;
-        }
-      }
-    }
+static void start_trace() {
+  trace_header_t header = { TRACE_MAGIC, TRACE_VERSION };
+
+  if (options.trace == NULL)
+    return;
+  trace.fd = open(options.trace, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (trace.fd < 0) {
+    fprintf(stderr, "Cannot open trace %s\n", options.trace);
+    return;
   }
-  return 1;
+  trace.buffer = malloc(TRACE_BUFFER);
+  memcpy(trace.buffer, &header, sizeof(header));
+  trace.length = sizeof(header);
+  trace.start = trace_now();
+}
+
+static void stop_trace() {
+  if (trace.fd < 0)
+    return;
+  pthread_mutex_lock(&trace.lock);
+  trace_write_buffer();
+  close(trace.fd);
+  trace.fd = -1;
+  pthread_mutex_unlock(&trace.lock);
 }
 
+#if FUSE_USE_VERSION >= 30
+static int fat_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi) {
+#else
 static int fat_utimens(const char *path, const struct timespec tv[2]) {
+#endif
   char * dir = malloc(strlen(path));
-  char filename[256];
-  split_dir_filename(path, dir, filename);
+  char filename[LFN_NAME_MAX];
+  if (split_dir_filename(path, dir, filename) != 0) {
+    free(dir);
+    return -ENAMETOOLONG;
+  }
 
   directory_t * directory = open_dir_from_path(dir);
   free(dir);
+  if (directory == NULL)
+    return -ENOENT;
   
+  tx_begin();
   int ret = updatedate_dir_entry(directory->cluster, filename, tv[0].tv_sec, tv[1].tv_sec);
+  if (tx_commit() != 0 && ret == 0)
+    ret = -EIO;
 
-  free(directory);
+  close_dir(directory);
+  invalidate_dir_cache();
 
   return ret;
 }
@@ -1011,107 +3969,153 @@ static int fat_mkdir (const char * path, mode_t mode) {
   fflush(debug);
 
   char * dir = malloc(strlen(path));
-  char filename[256];
-  split_dir_filename(path, dir, filename);
-
-  char * sfn = lfn_to_sfn(filename);
-  
-  int n_entries = 1 + ((strlen(filename) - 1) / 13);
-  lfn_entry_t * long_file_name = malloc(sizeof(lfn_entry_t) * (n_entries + 1));
-  fat_dir_entry_t *fentry = (fat_dir_entry_t*) &long_file_name[n_entries];
-
-  encode_long_file_name(filename, long_file_name, n_entries);
+  char filename[LFN_NAME_MAX];
+  if (split_dir_filename(path, dir, filename) != 0) {
+    free(dir);
+    return -ENAMETOOLONG;
+  }
 
-  strncpy(fentry->utf8_short_name, sfn, 8);
-  strncpy(fentry->file_extension, sfn + 8, 3);
+  fat_dir_entry_t entry;
+  fat_dir_entry_t *fentry = &entry;
   fentry->file_attributes = 0x10; //TODO: Utiliser variable mode et des defines.
   fentry->reserved = 0;
   fentry->create_time_ms = 0;
   time_t t = time(NULL);
   convert_time_t_to_datetime_fat(t, &(fentry->create_time), &(fentry->create_date));
   convert_time_t_to_datetime_fat(t, NULL, &(fentry->last_access_date));
-  fentry->ea_index = 0; //XXX
   convert_time_t_to_datetime_fat(t, &(fentry->last_modif_time), &(fentry->last_modif_date));
   fentry->file_size = 0;
-  fentry->cluster_pointer = alloc_cluster(1);
-  init_dir_cluster(fentry->cluster_pointer);
+  tx_begin();
+  int cluster = alloc_cluster(1);
+  if (cluster < 0) {
+    tx_commit();
+    free(dir);
+    return -ENOSPC;
+  }
+  set_entry_cluster(fentry, cluster);
+  init_dir_cluster(cluster);
 
-  add_fat_dir_entry(dir, (fat_dir_entry_t*)long_file_name, n_entries + 1);
+  int ret = add_fat_dir_entry(dir, filename, fentry);
+  if (ret != 0)
+    set_fat_entry(cluster, 0);
+  if (tx_commit() != 0 && ret == 0)
+    ret = -EIO;
+  invalidate_dir_cache();
 
-  return 0;
+  free(dir);
+  return ret;
 }
 
+#if FUSE_USE_VERSION >= 30
+static int fat_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
+#else
 static int fat_getattr(const char *path, struct stat *stbuf)
+#endif
 {
+  if (ro_index.nodes) {
+    ro_node_t *node = ro_lookup(path);
+    if (node == NULL)
+      return -ENOENT;
+    ro_node_to_stat(node, stbuf);
+    return 0;
+  }
+
   fprintf(debug, "fat_getattr %s\n", path);
   fflush(debug);
 
   int res = 0;
 
-  memset(stbuf, 0, sizeof(struct stat));
-  stbuf->st_nlink = 2; // XXX
-  stbuf->st_mode = 0755;
-
   if(strcmp(path, "/") == 0) {
-    stbuf->st_mode |= S_IFDIR;
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_nlink = 2; // XXX
+    stbuf->st_mode = 0755 | S_IFDIR;
+  } else if (neg_cache_lookup(path)) {
+    res = -ENOENT;
   } else {
     directory_t *dir;
-    char filename[256];
+    char filename[LFN_NAME_MAX];
     char * pathdir = malloc(strlen(path) + 1);
-    split_dir_filename(path, pathdir, filename);
-    if ((dir = open_dir_from_path(pathdir)) == NULL)
-      return -ENOENT;
+    if (split_dir_filename(path, pathdir, filename) != 0) {
+      free(pathdir);
+      return -ENAMETOOLONG;
+    }
+
+    // A miss reads the disk without the lock, other lookups go on. If the
+    // cache was dropped meanwhile, what was read may be stale already : it
+    // answers this call only.
+    directory_t *own = NULL;
+    pthread_mutex_lock(&dir_cache.lock);
+    if ((dir = lookup_dir_cache(pathdir)) == NULL) {
+      uint64_t generation = dir_cache.generation;
+      pthread_mutex_unlock(&dir_cache.lock);
+      if ((dir = open_dir_from_path(pathdir)) == NULL) {
+        free(pathdir);
+        return -ENOENT;
+      }
+      pthread_mutex_lock(&dir_cache.lock);
+      if (dir_cache.generation == generation)
+        store_dir_cache(pathdir, dir);
+      else
+        own = dir;
+    }
     free(pathdir);
 
+    uint32_t hash = name_hash(filename);
     directory_entry_t *dir_entry = dir->entries;
     while (dir_entry) {
-      if (strcmp(dir_entry->name, filename) == 0) {
+      if (entry_matches(dir_entry, filename, hash)) {
           break;
       }
       dir_entry = dir_entry->next;
     }
     if (!dir_entry) {
-      free(dir); // TODO: liberer memoire liste chainee.
-      return -ENOENT;
+      res = -ENOENT;
+      if (own == NULL)
+        neg_cache_insert(path);
     } else {
-      if (dir_entry->attributes & 0x01) { // Read Only
-        stbuf->st_mode &= ~0111;
-      }
-      if (dir_entry->attributes & 0x10) { // Dir.
-        stbuf->st_mode |= S_IFDIR;
-      } else {
-        stbuf->st_mode |= S_IFREG;
-      }
-      stbuf->st_atime = dir_entry->access_time;
-      stbuf->st_mtime = dir_entry->modification_time;
-      stbuf->st_ctime = dir_entry->creation_time;
-      stbuf->st_size = dir_entry->size;
+      directory_entry_to_stat(dir_entry, stbuf);
     }
-    free(dir); // TODO: liberer memoire liste chainee.
+    pthread_mutex_unlock(&dir_cache.lock);
+    close_dir(own);
   }
 
   return res;
 }
 
+#if FUSE_USE_VERSION >= 30
+static int fat_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                         off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+#else
 static int fat_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                          off_t offset, struct fuse_file_info *fi)
+#endif
 {
-  (void) offset;
   (void) fi;
-  directory_t *dir;
+  dir_iter_t it;
+  directory_entry_t entry;
+  struct stat st;
+  int cluster;
+  int ret;
 
-  fprintf(debug, "fat_readdir %s\n", path);
-  fflush(debug);
+  if (ro_index.nodes)
+    return ro_readdir(path, buf, filler, offset);
 
-  if ((dir = open_dir_from_path(path)) == NULL)
-    return -ENOENT;
+  fprintf(debug, "fat_readdir %s %ld\n", path, (long) offset);
+  fflush(debug);
 
-  directory_entry_t *dir_entry = dir->entries;
-  while (dir_entry) {
-    filler(buf, dir_entry->name, NULL, 0);
-    dir_entry = dir_entry->next;
+  if ((ret = open_dir_cluster(path, &cluster)) != 0)
+    return ret;
+
+  // offset is the index of the slot where the previous call stopped : the
+  // directory is decoded one cluster at a time from there, and the entries
+  // are handed out as soon as they are decoded, with their attributes.
+  dir_iter_open(&it, cluster, offset);
+  while (dir_iter_next(&it, &entry) == 0) {
+    directory_entry_to_stat(&entry, &st);
+    if (FAT_FILL_DIR(filler, buf, entry.name, &st, it.slot))
+      break;
   }
-  free(dir); // TODO: libérer liste chainée.
+  dir_iter_close(&it);
 
   return 0;
 }
@@ -1120,6 +4124,12 @@ static int fat_open(const char *path, struct fuse_file_info *fi)
 {
   directory_entry_t *f;
 
+  if (ro_index.nodes) {
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+      return -EROFS;
+    return ro_lookup(path) ? 0 : -ENOENT;
+  }
+
   if ((f = open_file_from_path(path)) == NULL)
     return -ENOENT;
 
@@ -1128,16 +4138,80 @@ static int fat_open(const char *path, struct fuse_file_info *fi)
   return 0;
 }
 
+// Reads or writes [offset, offset + size) of the chain starting at cluster.
+// The request is mapped to one iovec per cluster up front, and every run of
+// physically contiguous clusters is issued as a single vectored call.
+#define CHAIN_IO_IOV 256
+static ssize_t chain_io(uint32_t cluster, char *buf, size_t size, off_t offset, int write) {
+  uint32_t cluster_size = fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector;
+  struct iovec iov[CHAIN_IO_IOV];
+  int n = 0;
+  off_t start = 0, next = 0;
+  size_t mapped = 0, run = 0;
+  ssize_t total = 0;
+  off_t skip;
+
+  for (skip = offset / cluster_size; skip > 0 && is_used_cluster(cluster); skip--)
+    cluster = fat_info.file_alloc_table[cluster];
+  offset %= cluster_size;
+
+  for (;;) {
+    int more = mapped < size && is_used_cluster(cluster);
+    off_t addr = more ? cluster_addr(cluster) + offset : 0;
+
+    if (n > 0 && (!more || addr != next || n == CHAIN_IO_IOV)) {
+      if (write)
+        journal_revoke(start, run);
+      ssize_t r = write ? device->writev(iov, n, start) : device->readv(iov, n, start);
+      if (r < 0)
+        return total > 0 ? total : -EIO;
+      total += r;
+      if ((size_t) r < run)
+        return total;
+      n = 0;
+      run = 0;
+    }
+    if (!more)
+      break;
+
+    size_t len = cluster_size - offset < size - mapped ? cluster_size - offset : size - mapped;
+    if (n == 0)
+      start = addr;
+    iov[n].iov_base = buf + mapped;
+    iov[n].iov_len = len;
+    n++;
+    run += len;
+    mapped += len;
+    next = addr + len;
+    offset = 0;
+    cluster = fat_info.file_alloc_table[cluster];
+  }
+  return total;
+}
+
 static int fat_read(const char *path, char *buf, size_t size, off_t offset,
                       struct fuse_file_info *fi)
 {
   directory_entry_t *f;
-  int count = 0;
+
+  if (ro_index.nodes) {
+    ro_node_t *node = ro_lookup(path);
+    if (node == NULL)
+      return -ENOENT;
+    if (node->attributes & 0x10)
+      return -EISDIR;
+    return ro_read(node, buf, size, offset);
+  }
   
-  if ((f = open_file_from_path(path)) == NULL)
+  pthread_rwlock_rdlock(&relocate_lock);
+  if ((f = open_file_from_path(path)) == NULL) {
+    pthread_rwlock_unlock(&relocate_lock);
     return -ENOENT;
+  }
 
   if (offset >= f->size) {
+    pthread_rwlock_unlock(&relocate_lock);
+    free(f);
     return 0;
   }
 
@@ -1145,137 +4219,328 @@ static int fat_read(const char *path, char *buf, size_t size, off_t offset,
     size = f->size - offset;
   }
 
-  int fd = open(options.device, O_RDONLY);
-
-  int cluster = f->cluster;
-
-  // Offset
-  if (offset > 0) {
-    while (offset > fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector) {
-      cluster = fat_info.file_alloc_table[cluster];
-      offset -= fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector;
-    }
-    size_t size2 = fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector - offset;
-    if (size2 > size)
-      size2 = size;
-    pread(fd, buf, size2, fat_info.addr_data + offset + (cluster - 2) * fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector);
-    size -= size2;
-    count += size2;
-    cluster = fat_info.file_alloc_table[cluster];
-  }
+  ssize_t count = chain_io(f->cluster, buf, size, offset, 0);
 
-  while (size) {
-    size_t size2 = fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector;
-    if (size2 > size)
-      size2 = size;
-    pread(fd, buf + count, size2, fat_info.addr_data + (cluster - 2) * fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector);
-    size -= size2;
-    count += size2;
-    cluster = fat_info.file_alloc_table[cluster];
-  } 
-  
-  close(fd);
+  pthread_rwlock_unlock(&relocate_lock);
 
   free(f);
 
   return count;
 }
 
+static int find_dir_entry(int dir_cluster, const char *name, fat_dir_entry_t *fentry);
+
+// Writes past the end grow the file : its chain is extended from the group
+// it lives in, and the hole between the old size and offset is zeroed.
 static int fat_write (const char *path, const char *buf, size_t size, off_t offset,
                        struct fuse_file_info *fi)
 {
-  directory_entry_t *f;
-  int count = 0;
-  
-  if ((f = open_file_from_path(path)) == NULL)
-    return -ENOENT;
-
-  if (offset >= f->size) {
-    return 0;
+  uint32_t cluster_size = fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector;
+  fat_dir_entry_t entry;
+  char filename[LFN_NAME_MAX];
+  int dir_cluster, ret;
+
+  // File sizes are 32 bits.
+  if ((uint64_t) offset + size > 0xFFFFFFFFULL)
+    return -EFBIG;
+
+  char * dir = malloc(strlen(path) + 1);
+  if (split_dir_filename(path, dir, filename) != 0) {
+    free(dir);
+    return -ENAMETOOLONG;
+  }
+  pthread_rwlock_rdlock(&relocate_lock);
+  ret = open_dir_cluster(dir, &dir_cluster);
+  free(dir);
+  if (ret != 0) {
+    pthread_rwlock_unlock(&relocate_lock);
+    return ret;
   }
 
-  if (size + offset > f->size) {
-    size = f->size - offset;
+  // The entry is read again under the file lock, another writer may have
+  // grown the file meanwhile, or given it its first cluster. The directory
+  // cannot move : relocate_lock is held.
+  pthread_mutex_t *lock;
+  uint32_t first;
+  for (;;) {
+    if (find_dir_entry(dir_cluster, filename, &entry) != 0) {
+      pthread_rwlock_unlock(&relocate_lock);
+      return -ENOENT;
+    }
+    first = entry_cluster(&entry);
+    lock = &file_locks[first % FILE_LOCKS];
+    pthread_mutex_lock(lock);
+    if (find_dir_entry(dir_cluster, filename, &entry) == 0 && entry_cluster(&entry) == first)
+      break;
+    pthread_mutex_unlock(lock);
   }
+  uint32_t file_size = entry.file_size;
 
-  int fd = open(options.device, O_WRONLY);
+  if (first == defrag.moving)
+    defrag.moving_dirty = 1;
 
-  int cluster = f->cluster;
+  uint32_t cluster = first;
+  ssize_t count;
+  if (offset + size <= file_size) {
+    count = chain_io(cluster, (char*) buf, size, offset, 1);
+  } else {
+    uint32_t need = (offset + size + cluster_size - 1) / cluster_size;
+    uint32_t have = 0, tail = 0, c;
+    for (c = cluster; is_used_cluster(c) && have < need; c = fat_info.file_alloc_table[c]) {
+      tail = c;
+      have++;
+    }
 
-  // Offset
-  if (offset > 0) {
-    while (offset > fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector) {
-      cluster = fat_info.file_alloc_table[cluster];
-      offset -= fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector;
+    tx_begin();
+    if (have < need) {
+      uint32_t more = alloc_chain(tail ? tail + 1 : 0, tail, need - have);
+      if (more == 0) {
+        tx_commit();
+        pthread_mutex_unlock(lock);
+        pthread_rwlock_unlock(&relocate_lock);
+        return -ENOSPC;
+      }
+      if (tail == 0)
+        cluster = more;
     }
-    size_t size2 = fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector - offset;
-    if (size2 > size)
-      size2 = size;
-    pwrite(fd, buf, size2, fat_info.addr_data + offset + (cluster - 2) * fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector);
-    size -= size2;
-    count += size2;
-    cluster = fat_info.file_alloc_table[cluster];
-  }
 
-  while (size) {
-    size_t size2 = fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector;
-    if (size2 > size)
-      size2 = size;
-    pwrite(fd, buf + count, size2, fat_info.addr_data + (cluster - 2) * fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector);
-    size -= size2;
-    count += size2;
-    cluster = fat_info.file_alloc_table[cluster];
-  } 
-  
-  close(fd);
+    off_t hole = file_size;
+    if (hole < offset) {
+      size_t zeros_size = offset - hole < 1 << 16 ? offset - hole : 1 << 16;
+      char *zeros = calloc(1, zeros_size);
+      while (hole < offset) {
+        size_t len = offset - hole < zeros_size ? offset - hole : zeros_size;
+        chain_io(cluster, zeros, len, hole, 1);
+        hole += len;
+      }
+      free(zeros);
+    }
 
-  free(f);
+    count = chain_io(cluster, (char*) buf, size, offset, 1);
+    if (count > 0 || cluster != first)
+      set_dir_entry_size(dir_cluster, filename, first, cluster,
+                         count > 0 && offset + count > file_size ? offset + count : file_size);
+    if (tx_commit() != 0)
+      count = -EIO;
+    invalidate_dir_cache();
+  }
+
+  pthread_mutex_unlock(lock);
+  pthread_rwlock_unlock(&relocate_lock);
 
   return count;
 }
 
 static int fat_mknod(const char * path, mode_t mode, dev_t dev) {
 	char * dir = malloc(strlen(path));
-  char filename[256];
-  split_dir_filename(path, dir, filename);
-
-  char * sfn = lfn_to_sfn(filename);
-  
-  int n_entries = 1 + ((strlen(filename) - 1) / 13);
-  lfn_entry_t * long_file_name = malloc(sizeof(lfn_entry_t) * (n_entries + 1));
-  fat_dir_entry_t *fentry = (fat_dir_entry_t*) &long_file_name[n_entries];
-
-  encode_long_file_name(filename, long_file_name, n_entries);
+  char filename[LFN_NAME_MAX];
+  if (split_dir_filename(path, dir, filename) != 0) {
+    free(dir);
+    return -ENAMETOOLONG;
+  }
 
-  strncpy(fentry->utf8_short_name, sfn, 8);
-  strncpy(fentry->file_extension, sfn + 8, 3);
+  fat_dir_entry_t entry;
+  fat_dir_entry_t *fentry = &entry;
   fentry->file_attributes = 0x0; //TODO: Utiliser variable mode.
   fentry->reserved = 0;
   fentry->create_time_ms = 0;
   time_t t = time(NULL);
   convert_time_t_to_datetime_fat(t, &(fentry->create_time), &(fentry->create_date));
   convert_time_t_to_datetime_fat(t, NULL, &(fentry->last_access_date));
-  fentry->ea_index = 0; //XXX
   convert_time_t_to_datetime_fat(t, &(fentry->last_modif_time), &(fentry->last_modif_date));
   fentry->file_size = 0;
-  fentry->cluster_pointer = alloc_cluster(1);
-  init_dir_cluster(fentry->cluster_pointer);
-
-  add_fat_dir_entry(dir, (fat_dir_entry_t*)long_file_name, n_entries + 1);
+  tx_begin();
+  int cluster = alloc_cluster(1);
+  if (cluster < 0) {
+    tx_commit();
+    free(dir);
+    return -ENOSPC;
+  }
+  set_entry_cluster(fentry, cluster);
+  // The cluster of a file holds data : it is zeroed on the device, not
+  // through the log.
+  uint32_t cluster_size = fat_info.BS.sectors_per_cluster * fat_info.BS.bytes_per_sector;
+  char *zeros = calloc(1, cluster_size);
+  chain_io(cluster, zeros, cluster_size, 0, 1);
+  free(zeros);
+
+  int ret = add_fat_dir_entry(dir, filename, fentry);
+  if (ret != 0)
+    set_fat_entry(cluster, 0);
+  if (tx_commit() != 0 && ret == 0)
+    ret = -EIO;
+  invalidate_dir_cache();
 
 	free(dir);
-	return 0;
+	return ret;
+}
+
+static int fat_statfs(const char *path, struct statvfs *stbuf) {
+  memset(stbuf, 0, sizeof(struct statvfs));
+  stbuf->f_bsize = fat_info.BS.bytes_per_sector * fat_info.BS.sectors_per_cluster;
+  stbuf->f_frsize = stbuf->f_bsize;
+  stbuf->f_blocks = fat_info.total_data_clusters;
+  stbuf->f_bfree = fat_info.free_clusters;
+  stbuf->f_bavail = fat_info.free_clusters;
+  stbuf->f_namemax = 255;
+  return 0;
+}
+
+// Group commit : fsync, and flush on close, join the next commit instead of
+// each writing back on its own. The first caller to find none running leads
+// it, for every request made so far, the others wait for the one covering
+// theirs. A commit is durable if one of its requests is an fsync.
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  int running;
+  uint64_t requested;      // requests made so far
+  uint64_t durable;        // latest request that was an fsync
+  uint64_t completed;      // requests covered by the last commit
+  int error;               // of the last failed commit,
+  uint64_t error_from;     // for the requests in (error_from, error_upto]
+  uint64_t error_upto;
+  uint64_t fsyncs;
+  uint64_t commits;        // durable ones
+} commit = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+// File data is written to the device by fat_write itself, FAT and directory
+// entries either in place or through the journal. What is left is put in
+// order behind it : the FAT mirrors, FSInfo, then the journal is applied (by
+// offset : FAT sectors before directory clusters), and the device is synced
+// once.
+static int group_write(int durable) {
+  sync_fat_mirrors();
+  write_fs_info();
+  if (!durable)
+    return 0;
+  if (journal.running) {
+    // Ends with device->flush.
+    journal_flush();
+    return 0;
+  }
+  return device->flush() == 0 ? 0 : -EIO;
 }
 
+static int group_commit(int durable) {
+  pthread_mutex_lock(&commit.lock);
+  uint64_t seq = ++commit.requested;
+  if (durable) {
+    commit.durable = seq;
+    commit.fsyncs++;
+  }
+  while (commit.completed < seq) {
+    if (commit.running) {
+      pthread_cond_wait(&commit.done, &commit.lock);
+      continue;
+    }
+    uint64_t from = commit.completed, upto = commit.requested;
+    int sync = commit.durable > commit.completed;
+    commit.running = 1;
+    pthread_mutex_unlock(&commit.lock);
+    int error = group_write(sync);
+    pthread_mutex_lock(&commit.lock);
+    commit.running = 0;
+    commit.completed = upto;
+    if (error) {
+      commit.error = error;
+      commit.error_from = from;
+      commit.error_upto = upto;
+    }
+    commit.commits += sync;
+    pthread_cond_broadcast(&commit.done);
+  }
+  int ret = seq > commit.error_from && seq <= commit.error_upto ? commit.error : 0;
+  pthread_mutex_unlock(&commit.lock);
+  return ret;
+}
+
+static int fat_flush(const char *path, struct fuse_file_info *fi) {
+  if (options.readonly)
+    return 0;
+  return group_commit(0);
+}
+
+static int fat_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+  if (options.readonly)
+    return 0;
+  return group_commit(1);
+}
+
+// Nothing is kept per open file : flush already caught the metadata up.
+static int fat_release(const char *path, struct fuse_file_info *fi) {
+  return 0;
+}
+
+#if FUSE_USE_VERSION >= 30
+static void * fat_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+  // Few large requests : writes are gathered in the kernel page cache and
+  // sent up to FAT_MAX_WRITE at a time, lookups and readdir of one directory
+  // run in parallel, and listings come with attributes.
+  // max_read is left alone : libfuse refuses the connection when it differs
+  // from the max_read mount option, reads are bounded by max_pages anyway.
+  conn->max_write = FAT_MAX_WRITE;
+  conn->max_readahead = FAT_MAX_WRITE;
+  conn->want |= conn->capable & (FUSE_CAP_WRITEBACK_CACHE | FUSE_CAP_PARALLEL_DIROPS | FUSE_CAP_READDIRPLUS);
+  conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
+  cfg->entry_timeout = 1.0;
+  cfg->attr_timeout = 1.0;
+  if (options.readonly) {
+    // Nothing ever changes.
+    cfg->entry_timeout = 3600.0;
+    cfg->attr_timeout = 3600.0;
+    cfg->negative_timeout = 3600.0;
+    cfg->kernel_cache = 1;
+  }
+#else
+static void * fat_init(struct fuse_conn_info *conn) {
+#endif
+  // Started here : fuse_main forks before calling init.
+  start_trace();
+  // A replay leaves the background work out, for reproducible timings.
+  if (!options.readonly && !options.replay) {
+    start_journal();
+    start_reclaimer();
+    start_defrag();
+  }
+  return NULL;
+}
+
+static void fat_destroy(void *private_data) {
+  if (!options.readonly) {
+    stop_defrag();
+    stop_reclaimer();
+    sync_fat_mirrors();
+    write_fs_info();
+    stop_journal();
+    if (commit.fsyncs)
+      fprintf(stderr, "%lu fsyncs in %lu commits\n", (unsigned long) commit.fsyncs, (unsigned long) commit.commits);
+  }
+  stop_trace();
+  device->close();
+}
+
+#if FUSE_USE_VERSION >= 30
+static int fat_chmod(const char * path, mode_t mode, struct fuse_file_info *fi) {
+#else
 static int fat_chmod(const char * path, mode_t mode) {
+#endif
   return 0;
 }
 
+#if FUSE_USE_VERSION >= 30
+static int fat_chown(const char * path, uid_t uid, gid_t gid, struct fuse_file_info *fi) {
+#else
 static int fat_chown(const char * path, uid_t uid, gid_t gid) {
+#endif
   return 0;
 }
 
+#if FUSE_USE_VERSION >= 30
+static int fat_truncate(const char * path, off_t off, struct fuse_file_info *fi) {
+#else
 static int fat_truncate(const char * path, off_t off) {
+#endif
   return 0;
 }
 
@@ -1287,7 +4552,7 @@ static int fat_unlink(const char * path) {
   if (path[0] != '/')
     return -1;
 
-  char buf[256];
+  char buf[LFN_NAME_MAX];
   int i = 1;
   while (path[i] == '/')
     i++;
@@ -1302,15 +4567,24 @@ static int fat_unlink(const char * path) {
 			int cluster = dir->cluster;
       if (j > 0 && open_next_dir(dir, dir, buf) == 2) {
 				  fprintf(debug, "delete, name = %s\n", buf);
-					delete_file_dir(cluster, buf);
+					tx_begin();
+					uint32_t chain = delete_file_dir(cluster, buf);
+					int ret = tx_commit();
+					queue_reclaim(chain);
 				  fflush(debug);
+					close_dir(dir);
+					invalidate_dir_cache();
 
 
-					return 0;
+					return ret;
 			}
 
       j = 0;
     } else {
+      if (j == LFN_NAME_MAX - 1) {
+        close_dir(dir);
+        return -ENAMETOOLONG;
+      }
       buf[j] = path[i];
       j++;
     }
@@ -1319,15 +4593,864 @@ static int fat_unlink(const char * path) {
 	return 1;
 }
 
+// Copies the short name entry of name in the directory at dir_cluster.
+// Returns 1 if there is no such entry.
+static int find_dir_entry(int dir_cluster, const char *name, fat_dir_entry_t *fentry) {
+  dir_iter_t it;
+  directory_entry_t entry;
+  int ret = 1;
+
+  uint32_t hash = name_hash(name);
+  dir_iter_open(&it, dir_cluster, 0);
+  while (dir_iter_next(&it, &entry) == 0) {
+    if (entry_matches(&entry, name, hash)) {
+      memcpy(fentry, &it.entries[it.slot - 1 - it.first], sizeof(fat_dir_entry_t));
+      ret = 0;
+      break;
+    }
+  }
+  dir_iter_close(&it);
+  return ret;
+}
+
+static int is_empty_dir(int dir_cluster) {
+  dir_iter_t it;
+  directory_entry_t entry;
+  int empty = 1;
+
+  dir_iter_open(&it, dir_cluster, 0);
+  while (dir_iter_next(&it, &entry) == 0) {
+    if (strcmp(entry.name, ".") != 0 && strcmp(entry.name, "..") != 0) {
+      empty = 0;
+      break;
+    }
+  }
+  dir_iter_close(&it);
+  return empty;
+}
+
+// Points the ".." entry of a moved directory at its new parent, 0 for the root.
+static void set_parent_dir(int dir_cluster, uint32_t parent) {
+  dir_iter_t it;
+  directory_entry_t entry;
+
+  dir_iter_open(&it, dir_cluster, 0);
+  while (dir_iter_next(&it, &entry) == 0) {
+    if (strcmp(entry.name, "..") == 0) {
+      int slot = it.slot - 1;
+      fat_dir_entry_t *fdir = &it.entries[slot - it.first];
+      set_entry_cluster(fdir, parent);
+      write_data(fdir, sizeof(fat_dir_entry_t), dir_iter_addr(&it, slot));
+      break;
+    }
+  }
+  dir_iter_close(&it);
+}
+
+// Moves the entry group of from to to : the short name entry is copied as
+// is, so only directory slots are written whatever the size of the file. An
+// existing to is replaced, and its clusters are reclaimed.
+#if FUSE_USE_VERSION >= 30
+static int fat_rename(const char *from, const char *to, unsigned int flags) {
+#else
+static int fat_rename(const char *from, const char *to) {
+  unsigned int flags = 0;
+#endif
+
+  if (flags & ~RENAME_NOREPLACE)
+    return -EINVAL;
+  if (from[0] != '/' || to[0] != '/' || strcmp(from, "/") == 0 || strcmp(to, "/") == 0)
+    return -EINVAL;
+  if (strcmp(from, to) == 0)
+    return 0;
+  const char *rest = fold_prefix(to, from);
+  if (rest != NULL && *rest == '/')
+    return -EINVAL;
+
+  char * from_dir = malloc(strlen(from));
+  char * to_dir = malloc(strlen(to));
+  char from_name[LFN_NAME_MAX], to_name[LFN_NAME_MAX];
+  if (split_dir_filename(from, from_dir, from_name) != 0 || split_dir_filename(to, to_dir, to_name) != 0) {
+    free(from_dir);
+    free(to_dir);
+    return -ENAMETOOLONG;
+  }
+
+  int from_cluster, to_cluster;
+  fat_dir_entry_t entry, target;
+  int has_target = 0;
+  int ret;
+
+  pthread_rwlock_rdlock(&relocate_lock);
+  if ((ret = open_dir_cluster(from_dir, &from_cluster)) != 0 || (ret = open_dir_cluster(to_dir, &to_cluster)) != 0)
+    goto out;
+  if (find_dir_entry(from_cluster, from_name, &entry) != 0) {
+    ret = -ENOENT;
+    goto out;
+  }
+  // A change of case only : to is from itself, not an entry to replace.
+  int same = from_cluster == to_cluster && name_equal(from_name, to_name);
+  if (!same && find_dir_entry(to_cluster, to_name, &target) == 0) {
+    has_target = 1;
+    if (flags & RENAME_NOREPLACE) {
+      ret = -EEXIST;
+      goto out;
+    }
+    if (target.file_attributes & 0x10) {
+      if (!(entry.file_attributes & 0x10))
+        ret = -EISDIR;
+      else if (!is_empty_dir(entry_cluster(&target)))
+        ret = -ENOTEMPTY;
+    } else if (entry.file_attributes & 0x10) {
+      ret = -ENOTDIR;
+    }
+    if (ret != 0)
+      goto out;
+  }
+
+  // Both old entries go first, names are matched case insensitively and the
+  // new one could match too. They gave their slots back, so they fit again
+  // if the new one does not.
+  tx_begin();
+  uint32_t chain = has_target ? delete_file_dir(to_cluster, to_name) : 0;
+  delete_file_dir(from_cluster, from_name);
+  if ((ret = add_fat_dir_entry(to_dir, to_name, &entry)) != 0) {
+    add_fat_dir_entry(from_dir, from_name, &entry);
+    if (has_target)
+      add_fat_dir_entry(to_dir, to_name, &target);
+    tx_commit();
+    goto out;
+  }
+  if ((entry.file_attributes & 0x10) && from_cluster != to_cluster)
+    set_parent_dir(entry_cluster(&entry), to_dir[0] == '\0' ? 0 : to_cluster);
+  ret = tx_commit();
+
+  if (has_target) {
+    forget_dir_slots(to);
+    queue_reclaim(chain);
+  }
+  if (entry.file_attributes & 0x10) {
+    forget_dir_slots(from);
+    neg_cache_remove(NULL, NULL);
+  }
+  invalidate_dir_cache();
+
+out:
+  pthread_rwlock_unlock(&relocate_lock);
+  free(from_dir);
+  free(to_dir);
+  return ret;
+}
+
+// Consistency checker : directories are spread over a pool of threads with
+// one deque each, idle threads steal from the others. Every cluster reached
+// from the tree is marked in a shared bitmap, a cluster marked twice is
+// cross-linked, a used cluster never marked is lost.
+
+typedef struct _fsck_work {
+  int cluster;
+  char *path;
+} fsck_work_t;
+
+typedef struct _fsck_deque {
+  pthread_mutex_t lock;
+  fsck_work_t *items;
+  int head;                // steal end
+  int tail;                // owner end
+  int size;
+} fsck_deque_t;
+
+static struct {
+  int n_threads;
+  fsck_deque_t *deques;
+  atomic_int pending;      // queued or being processed
+  _Atomic uint64_t *marked;
+  atomic_uint errors;
+  atomic_uint repaired;
+  pthread_mutex_t lock;    // cuts and output
+  uint32_t *cuts;          // clusters that must become the end of their chain
+  int n_cuts;
+  int max_cuts;
+} fsck;
+
+static void fsck_report(const char *path, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+
+static void fsck_report(const char *path, const char *fmt, ...) {
+  va_list ap;
+  pthread_mutex_lock(&fsck.lock);
+  printf("%s: ", path[0] ? path : "/");
+  va_start(ap, fmt);
+  vprintf(fmt, ap);
+  va_end(ap);
+  printf("\n");
+  pthread_mutex_unlock(&fsck.lock);
+  atomic_fetch_add(&fsck.errors, 1);
+}
+
+static void fsck_push(int worker, int cluster, char *path) {
+  fsck_deque_t *dq = &fsck.deques[worker];
+  atomic_fetch_add(&fsck.pending, 1);
+  pthread_mutex_lock(&dq->lock);
+  if (dq->tail == dq->size) {
+    memmove(dq->items, dq->items + dq->head, sizeof(fsck_work_t) * (dq->tail - dq->head));
+    dq->tail -= dq->head;
+    dq->head = 0;
+    if (dq->tail == dq->size) {
+      dq->size = dq->size ? dq->size * 2 : 64;
+      dq->items = realloc(dq->items, sizeof(fsck_work_t) * dq->size);
+    }
+  }
+  dq->items[dq->tail].cluster = cluster;
+  dq->items[dq->tail].path = path;
+  dq->tail++;
+  pthread_mutex_unlock(&dq->lock);
+}
+
+// Takes from the owner end of its own deque, else from the other end of
+// another one.
+static int fsck_pop(int worker, fsck_work_t *work) {
+  int i;
+  for (i = 0; i < fsck.n_threads; i++) {
+    int victim = (worker + i) % fsck.n_threads;
+    fsck_deque_t *dq = &fsck.deques[victim];
+    pthread_mutex_lock(&dq->lock);
+    if (dq->head < dq->tail) {
+      if (victim == worker)
+        *work = dq->items[--dq->tail];
+      else
+        *work = dq->items[dq->head++];
+      pthread_mutex_unlock(&dq->lock);
+      return 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+  }
+  return 0;
+}
+
+// Returns 1 if the cluster was already marked.
+static int fsck_mark(uint32_t cluster) {
+  uint64_t bit = (uint64_t) 1 << (cluster % 64);
+  return (atomic_fetch_or_explicit(&fsck.marked[cluster / 64], bit, memory_order_relaxed) & bit) != 0;
+}
+
+static void fsck_cut(uint32_t cluster) {
+  pthread_mutex_lock(&fsck.lock);
+  if (fsck.n_cuts == fsck.max_cuts) {
+    fsck.max_cuts = fsck.max_cuts ? fsck.max_cuts * 2 : 64;
+    fsck.cuts = realloc(fsck.cuts, sizeof(uint32_t) * fsck.max_cuts);
+  }
+  fsck.cuts[fsck.n_cuts++] = cluster;
+  pthread_mutex_unlock(&fsck.lock);
+}
+
+// Marks the clusters of a chain and returns its length. The walk stops on an
+// invalid or already marked cluster, and after keep clusters if keep > 0 and
+// repairing. *first_bad is set when the very first cluster is unusable.
+static uint32_t fsck_chain(const char *path, uint32_t cluster, uint32_t keep, int *first_bad) {
+  uint32_t end = fat_info.total_data_clusters + 2;
+  uint32_t n = 0;
+  uint32_t prev = 0;
+
+  *first_bad = 0;
+  for (;;) {
+    if (cluster < 2 || cluster >= end) {
+      fsck_report(path, "invalid cluster %u in chain", cluster);
+      break;
+    }
+    if (fsck_mark(cluster)) {
+      fsck_report(path, "cross-linked at cluster %u", cluster);
+      break;
+    }
+    n++;
+    uint32_t next = fat_info.file_alloc_table[cluster];
+    if (is_last_cluster(next))
+      return n;
+    if (options.fsck == 2 && keep > 0 && n == keep) {
+      // The rest is marked lost and freed with the other lost clusters.
+      fsck_report(path, "chain longer than the file size, cut after %u clusters", n);
+      fsck_cut(cluster);
+      return n;
+    }
+    if (!is_used_cluster(next)) {
+      fsck_report(path, "chain ends on free or bad cluster %u", next);
+      prev = cluster;
+      break;
+    }
+    prev = cluster;
+    cluster = next;
+  }
+
+  if (options.fsck == 2) {
+    if (prev)
+      fsck_cut(prev);
+    else
+      *first_bad = 1;
+  }
+  return n;
+}
+
+static void fsck_write_entry(dir_iter_t *it, int slot, fat_dir_entry_t *fdir) {
+  write_data(fdir, sizeof(fat_dir_entry_t), dir_iter_addr(it, slot));
+  atomic_fetch_add(&fsck.repaired, 1);
+}
+
+// Deletes an entry along with its long name.
+static void fsck_delete_entry(dir_iter_t *it, int slot, fat_dir_entry_t *fdir, off_t *addrs, int n) {
+  uint8_t deleted = 0xE5;
+  int i;
+  for (i = 0; i < n; i++)
+    write_data(&deleted, 1, addrs[i]);
+  fdir->utf8_short_name[0] = deleted;
+  fsck_write_entry(it, slot, fdir);
+}
+
+// Deletes the long name entries left without their short entry.
+static void fsck_drop_lfn(const char *path, off_t *addrs, int n) {
+  int i;
+  fsck_report(path, "broken long file name sequence (%d entries)", n);
+  if (options.fsck != 2)
+    return;
+  for (i = 0; i < n; i++) {
+    uint8_t deleted = 0xE5;
+    write_data(&deleted, 1, addrs[i]);
+  }
+  atomic_fetch_add(&fsck.repaired, 1);
+}
+
+static void fsck_dir(int worker, int dir_cluster, const char *path) {
+  uint32_t cluster_size = fat_info.BS.bytes_per_sector * fat_info.BS.sectors_per_cluster;
+  char filename[LFN_NAME_MAX];
+  uint16_t units[LFN_MAX_ENTRIES * 13];
+  int n_units = 0;
+  off_t lfn_addrs[LFN_MAX_ENTRIES];
+  int n_lfn = 0;
+  int expected = 0;        // sequence number of the next long name part
+  uint8_t checksum = 0;
+  dir_iter_t it;
+  fat_dir_entry_t *fdir;
+  int first_bad;
+
+  dir_iter_open(&it, dir_cluster, 0);
+  while ((fdir = dir_iter_slot(&it)) != NULL && fdir->utf8_short_name[0] != 0) {
+    int slot = it.slot++;
+    if ((unsigned char)fdir->utf8_short_name[0] == 0xE5) {
+      if (n_lfn)
+        fsck_drop_lfn(path, lfn_addrs, n_lfn);
+      n_lfn = expected = 0;
+      continue;
+    }
+
+    if (fdir->file_attributes == 0x0F) {
+      lfn_entry_t *lfn_entry = (lfn_entry_t*) fdir;
+      int seq = lfn_entry->seq_number & 0x1F;
+      if (lfn_entry->seq_number & 0x40) {
+        if (n_lfn)
+          fsck_drop_lfn(path, lfn_addrs, n_lfn);
+        n_lfn = 0;
+        expected = seq;
+        checksum = lfn_entry->checksum;
+        n_units = seq * 13;
+      }
+      if (seq < 1 || seq > LFN_MAX_ENTRIES || seq != expected || lfn_entry->checksum != checksum) {
+        lfn_addrs[n_lfn++] = dir_iter_addr(&it, slot);
+        fsck_drop_lfn(path, lfn_addrs, n_lfn);
+        n_lfn = expected = 0;
+        continue;
+      }
+      lfn_entry_units(units + (seq - 1) * 13, lfn_entry);
+      lfn_addrs[n_lfn++] = dir_iter_addr(&it, slot);
+      expected--;
+      continue;
+    }
+
+    if (n_lfn && (expected != 0 || lfn_checksum(fdir->utf8_short_name) != checksum)) {
+      fsck_drop_lfn(path, lfn_addrs, n_lfn);
+      n_lfn = 0;
+    }
+    if (n_lfn)
+      utf16_to_utf8(units, n_units, filename, sizeof(filename));
+    else
+      decode_short_file_name(filename, fdir);
+    int n_names = n_lfn;
+    n_lfn = expected = 0;
+
+    if ((fdir->file_attributes & 0x08) || strcmp(filename, ".") == 0 || strcmp(filename, "..") == 0)
+      continue;
+
+    char *child = malloc(strlen(path) + strlen(filename) + 2);
+    sprintf(child, "%s/%s", path, filename);
+    uint32_t cluster = entry_cluster(fdir);
+
+    // The directory's own chain is walked here, where its entry can still be
+    // repaired : if the first cluster is already marked, the directory is
+    // reached twice and must not be walked again. A directory with nothing
+    // to walk is deleted, its clusters are freed as lost.
+    if (fdir->file_attributes & 0x10) {
+      first_bad = 0;
+      if (cluster == 0) {
+        fsck_report(child, "directory without cluster");
+        first_bad = options.fsck == 2;
+      } else if (fsck_chain(child, cluster, 0, &first_bad) > 0) {
+        fsck_push(worker, cluster, child);
+        continue;
+      }
+      if (first_bad)
+        fsck_delete_entry(&it, slot, fdir, lfn_addrs, n_names);
+      free(child);
+      continue;
+    }
+
+    uint32_t needed = (fdir->file_size + cluster_size - 1) / cluster_size;
+    uint32_t n = 0;
+    first_bad = 0;
+    if (cluster != 0)
+      n = fsck_chain(child, cluster, needed ? needed : 1, &first_bad);
+
+    if (first_bad) {
+      set_entry_cluster(fdir, 0);
+      fdir->file_size = 0;
+      fsck_write_entry(&it, slot, fdir);
+    } else if (n < needed) {
+      fsck_report(child, "size %u larger than its %u clusters", fdir->file_size, n);
+      if (options.fsck == 2) {
+        fdir->file_size = n * cluster_size;
+        fsck_write_entry(&it, slot, fdir);
+      }
+    } else if (n > (needed ? needed : 1)) {
+      fsck_report(child, "%u clusters for a size of %u", n, fdir->file_size);
+    }
+    free(child);
+  }
+  if (n_lfn)
+    fsck_drop_lfn(path, lfn_addrs, n_lfn);
+  dir_iter_close(&it);
+}
+
+static void * fsck_worker(void *arg) {
+  int worker = (intptr_t) arg;
+  fsck_work_t work;
+
+  for (;;) {
+    if (!fsck_pop(worker, &work)) {
+      if (atomic_load(&fsck.pending) == 0)
+        break;
+      sched_yield();
+      continue;
+    }
+    fsck_dir(worker, work.cluster, work.path);
+    free(work.path);
+    atomic_fetch_sub(&fsck.pending, 1);
+  }
+  return NULL;
+}
+
+static int run_fsck() {
+  uint32_t end = fat_info.total_data_clusters + 2;
+  uint32_t i;
+  int first_bad;
+  int t;
+
+  fsck.n_threads = options.fsck_threads ? options.fsck_threads : sysconf(_SC_NPROCESSORS_ONLN);
+  if (fsck.n_threads < 1)
+    fsck.n_threads = 1;
+  fsck.deques = calloc(fsck.n_threads, sizeof(fsck_deque_t));
+  for (t = 0; t < fsck.n_threads; t++)
+    pthread_mutex_init(&fsck.deques[t].lock, NULL);
+  fsck.marked = calloc(end / 64 + 1, sizeof(uint64_t));
+  pthread_mutex_init(&fsck.lock, NULL);
+  atomic_init(&fsck.pending, 0);
+  atomic_init(&fsck.errors, 0);
+  atomic_init(&fsck.repaired, 0);
+
+  fprintf(stderr, "Checking with %d threads.\n", fsck.n_threads);
+  if (fat_info.fat_type != FAT32)
+    fsck_push(0, -1, strdup(""));
+  else if (fsck_chain("", fat_info.ext_BIOS_32->cluster_root_dir, 0, &first_bad) > 0)
+    fsck_push(0, fat_info.ext_BIOS_32->cluster_root_dir, strdup(""));
+
+  pthread_t *threads = malloc(sizeof(pthread_t) * fsck.n_threads);
+  for (t = 0; t < fsck.n_threads; t++)
+    pthread_create(&threads[t], NULL, fsck_worker, (void*)(intptr_t) t);
+  for (t = 0; t < fsck.n_threads; t++)
+    pthread_join(threads[t], NULL);
+  free(threads);
+
+  // Chains cut short end on the kept cluster, the rest is lost.
+  for (t = 0; t < fsck.n_cuts; t++)
+    set_fat_entry(fsck.cuts[t], last_cluster());
+
+  uint32_t lost = 0;
+  uint32_t *batch = malloc(sizeof(uint32_t) * RECLAIM_BATCH);
+  int n = 0;
+  for (i = 2; i < end; i++) {
+    uint32_t value = fat_info.file_alloc_table[i];
+    if ((is_used_cluster(value) || is_last_cluster(value)) &&
+        !(atomic_load_explicit(&fsck.marked[i / 64], memory_order_relaxed) & ((uint64_t) 1 << (i % 64)))) {
+      lost++;
+      if (options.fsck == 2) {
+        batch[n++] = i;
+        if (n == RECLAIM_BATCH) {
+          free_clusters(batch, n);
+          n = 0;
+        }
+      }
+    }
+  }
+  if (n > 0)
+    free_clusters(batch, n);
+  free(batch);
+  if (lost > 0) {
+    printf("%u lost clusters%s\n", lost, options.fsck == 2 ? " freed" : "");
+    atomic_fetch_add(&fsck.errors, 1);
+  }
+
+  if (options.fsck == 2) {
+    count_free_clusters();
+    fat_info.fs_info_dirty = 1;
+    write_fs_info();
+  }
+
+  printf("%u problems found, %u repaired.\n", atomic_load(&fsck.errors), atomic_load(&fsck.repaired) + (options.fsck == 2 ? lost : 0));
+  return atomic_load(&fsck.errors) ? 1 : 0;
+}
+
+// Wrappers of the operations recording them in the trace.
+#define TRACED(op, call, path, to, mode, offset, size) { \
+    uint64_t start = trace_now(); \
+    int ret = call; \
+    trace_record(op, path, to, mode, offset, size, ret, start); \
+    return ret; \
+  }
+
+#if FUSE_USE_VERSION >= 30
+static int traced_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
+  TRACED(TRACE_GETATTR, fat_getattr(path, stbuf, fi), path, NULL, 0, 0, 0)
+#else
+static int traced_getattr(const char *path, struct stat *stbuf)
+  TRACED(TRACE_GETATTR, fat_getattr(path, stbuf), path, NULL, 0, 0, 0)
+#endif
+
+// readdir records how many entries the caller took.
+typedef struct _traced_fill {
+  void *buf;
+  fuse_fill_dir_t filler;
+  uint32_t entries;
+} traced_fill_t;
+
+#if FUSE_USE_VERSION >= 30
+static int traced_filler(void *buf, const char *name, const struct stat *stbuf, off_t off, enum fuse_fill_dir_flags flags) {
+  traced_fill_t *fill = buf;
+  int full = fill->filler(fill->buf, name, stbuf, off, flags);
+#else
+static int traced_filler(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+  traced_fill_t *fill = buf;
+  int full = fill->filler(fill->buf, name, stbuf, off);
+#endif
+  if (!full)
+    fill->entries++;
+  return full;
+}
+
+#if FUSE_USE_VERSION >= 30
+static int traced_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                          off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
+  traced_fill_t fill = { buf, filler, 0 };
+  uint64_t start = trace_now();
+  int ret = fat_readdir(path, &fill, traced_filler, offset, fi, flags);
+#else
+static int traced_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                          off_t offset, struct fuse_file_info *fi) {
+  traced_fill_t fill = { buf, filler, 0 };
+  uint64_t start = trace_now();
+  int ret = fat_readdir(path, &fill, traced_filler, offset, fi);
+#endif
+  trace_record(TRACE_READDIR, path, NULL, 0, offset, fill.entries, ret, start);
+  return ret;
+}
+
+static int traced_open(const char *path, struct fuse_file_info *fi)
+  TRACED(TRACE_OPEN, fat_open(path, fi), path, NULL, fi->flags, 0, 0)
+
+static int traced_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+  TRACED(TRACE_READ, fat_read(path, buf, size, offset, fi), path, NULL, 0, offset, size)
+
+static int traced_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+  TRACED(TRACE_WRITE, fat_write(path, buf, size, offset, fi), path, NULL, 0, offset, size)
+
+static int traced_mknod(const char *path, mode_t mode, dev_t dev)
+  TRACED(TRACE_MKNOD, fat_mknod(path, mode, dev), path, NULL, mode, 0, 0)
+
+static int traced_mkdir(const char *path, mode_t mode)
+  TRACED(TRACE_MKDIR, fat_mkdir(path, mode), path, NULL, mode, 0, 0)
+
+static int traced_unlink(const char *path)
+  TRACED(TRACE_UNLINK, fat_unlink(path), path, NULL, 0, 0, 0)
+
+#if FUSE_USE_VERSION >= 30
+static int traced_rename(const char *from, const char *to, unsigned int flags)
+  TRACED(TRACE_RENAME, fat_rename(from, to, flags), from, to, flags, 0, 0)
+
+static int traced_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi)
+  TRACED(TRACE_UTIMENS, fat_utimens(path, tv, fi), path, NULL, 0, 0, 0)
+
+static int traced_chmod(const char *path, mode_t mode, struct fuse_file_info *fi)
+  TRACED(TRACE_CHMOD, fat_chmod(path, mode, fi), path, NULL, mode, 0, 0)
+
+static int traced_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi)
+  TRACED(TRACE_CHOWN, fat_chown(path, uid, gid, fi), path, NULL, 0, 0, 0)
+
+static int traced_truncate(const char *path, off_t off, struct fuse_file_info *fi)
+  TRACED(TRACE_TRUNCATE, fat_truncate(path, off, fi), path, NULL, 0, off, 0)
+#else
+static int traced_rename(const char *from, const char *to)
+  TRACED(TRACE_RENAME, fat_rename(from, to), from, to, 0, 0, 0)
+
+static int traced_utimens(const char *path, const struct timespec tv[2])
+  TRACED(TRACE_UTIMENS, fat_utimens(path, tv), path, NULL, 0, 0, 0)
+
+static int traced_chmod(const char *path, mode_t mode)
+  TRACED(TRACE_CHMOD, fat_chmod(path, mode), path, NULL, mode, 0, 0)
+
+static int traced_chown(const char *path, uid_t uid, gid_t gid)
+  TRACED(TRACE_CHOWN, fat_chown(path, uid, gid), path, NULL, 0, 0, 0)
+
+static int traced_truncate(const char *path, off_t off)
+  TRACED(TRACE_TRUNCATE, fat_truncate(path, off), path, NULL, 0, off, 0)
+#endif
+
+static int traced_statfs(const char *path, struct statvfs *stbuf)
+  TRACED(TRACE_STATFS, fat_statfs(path, stbuf), path, NULL, 0, 0, 0)
+
+static int traced_flush(const char *path, struct fuse_file_info *fi)
+  TRACED(TRACE_FLUSH, fat_flush(path, fi), path, NULL, 0, 0, 0)
+
+static int traced_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+  TRACED(TRACE_FSYNC, fat_fsync(path, datasync, fi), path, NULL, datasync, 0, 0)
+
+static int traced_release(const char *path, struct fuse_file_info *fi)
+  TRACED(TRACE_RELEASE, fat_release(path, fi), path, NULL, fi->flags, 0, 0)
+
+static struct fuse_operations traced_oper = {
+    .chmod = traced_chmod,
+    .chown = traced_chown,
+    .destroy = fat_destroy,
+    .flush = traced_flush,
+    .fsync = traced_fsync,
+    .mknod = traced_mknod,
+    .getattr = traced_getattr,
+    .init = fat_init,
+    .mkdir = traced_mkdir,
+    .open = traced_open,
+    .read = traced_read,
+    .release = traced_release,
+    .readdir = traced_readdir,
+    .rename = traced_rename,
+    .statfs = traced_statfs,
+    .truncate = traced_truncate,
+    .utimens = traced_utimens,
+    .write = traced_write,
+    .unlink = traced_unlink,
+};
+
+// Replay (-replay=FILE) : the calls of a trace are made again, one after the
+// other, directly on the operations, against an in-memory copy of the image
+// that is thrown away. Written data is a pattern, as traces keep no data.
+// Latency percentiles are reported per operation next to the recorded ones.
+static const char *trace_op_names[TRACE_OPS] = {
+  "getattr", "readdir", "open", "read", "write", "mknod", "mkdir", "unlink",
+  "rename", "utimens", "chmod", "chown", "truncate", "statfs", "flush",
+  "fsync", "release"
+};
+
+typedef struct _replay_fill {
+  uint32_t left;           // entries the recorded caller took
+} replay_fill_t;
+
+#if FUSE_USE_VERSION >= 30
+static int replay_filler(void *buf, const char *name, const struct stat *stbuf, off_t off, enum fuse_fill_dir_flags flags) {
+#else
+static int replay_filler(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+#endif
+  replay_fill_t *fill = buf;
+  if (fill->left == 0)
+    return 1;
+  fill->left--;
+  return 0;
+}
+
+static int compare_latency(const void *a, const void *b) {
+  uint32_t la = *(const uint32_t*) a, lb = *(const uint32_t*) b;
+  return la < lb ? -1 : la > lb;
+}
+
+static uint32_t percentile(uint32_t *sorted, size_t n, int p) {
+  size_t i = n * p / 100;
+  return sorted[i < n ? i : n - 1];
+}
+
+static int replay_call(trace_record_t *record, const char *path, const char *to, char *data) {
+  struct fuse_file_info fi;
+  struct stat st;
+  struct statvfs sv;
+  struct timespec tv[2];
+
+  memset(&fi, 0, sizeof(fi));
+  switch (record->op) {
+#if FUSE_USE_VERSION >= 30
+  case TRACE_GETATTR: return fat_getattr(path, &st, NULL);
+  case TRACE_READDIR: {
+    replay_fill_t fill = { record->size };
+    return fat_readdir(path, &fill, replay_filler, record->offset, &fi, FUSE_READDIR_PLUS);
+  }
+  case TRACE_RENAME: return fat_rename(path, to, record->mode);
+  case TRACE_UTIMENS:
+    clock_gettime(CLOCK_REALTIME, &tv[0]);
+    tv[1] = tv[0];
+    return fat_utimens(path, tv, NULL);
+  case TRACE_CHMOD: return fat_chmod(path, record->mode, NULL);
+  case TRACE_CHOWN: return fat_chown(path, 0, 0, NULL);
+  case TRACE_TRUNCATE: return fat_truncate(path, record->offset, NULL);
+#else
+  case TRACE_GETATTR: return fat_getattr(path, &st);
+  case TRACE_READDIR: {
+    replay_fill_t fill = { record->size };
+    return fat_readdir(path, &fill, replay_filler, record->offset, &fi);
+  }
+  case TRACE_RENAME: return fat_rename(path, to);
+  case TRACE_UTIMENS:
+    clock_gettime(CLOCK_REALTIME, &tv[0]);
+    tv[1] = tv[0];
+    return fat_utimens(path, tv);
+  case TRACE_CHMOD: return fat_chmod(path, record->mode);
+  case TRACE_CHOWN: return fat_chown(path, 0, 0);
+  case TRACE_TRUNCATE: return fat_truncate(path, record->offset);
+#endif
+  case TRACE_OPEN:
+    fi.flags = record->mode;
+    return fat_open(path, &fi);
+  case TRACE_READ: return fat_read(path, data, record->size, record->offset, &fi);
+  case TRACE_WRITE: return fat_write(path, data, record->size, record->offset, &fi);
+  case TRACE_MKNOD: return fat_mknod(path, record->mode, 0);
+  case TRACE_MKDIR: return fat_mkdir(path, record->mode);
+  case TRACE_UNLINK: return fat_unlink(path);
+  case TRACE_STATFS: return fat_statfs(path, &sv);
+  case TRACE_FLUSH: return fat_flush(path, &fi);
+  case TRACE_FSYNC: return fat_fsync(path, record->mode, &fi);
+  case TRACE_RELEASE:
+    fi.flags = record->mode;
+    return fat_release(path, &fi);
+  }
+  return -ENOSYS;
+}
+
+static int run_replay() {
+  trace_header_t header;
+  trace_record_t record;
+  uint32_t *latencies[TRACE_OPS], *recorded[TRACE_OPS];
+  size_t counts[TRACE_OPS], capacities[TRACE_OPS];
+  size_t data_size = 0, n = 0, differ = 0;
+  char *data = NULL;
+  int op;
+
+  FILE *in = fopen(options.replay, "r");
+  if (in == NULL || fread(&header, sizeof(header), 1, in) != 1 ||
+      header.magic != TRACE_MAGIC || header.version != TRACE_VERSION) {
+    fprintf(stderr, "Cannot read trace %s\n", options.replay);
+    if (in)
+      fclose(in);
+    return 1;
+  }
+
+  // Needs fuse_conn_info and fuse_config to write to.
+#if FUSE_USE_VERSION >= 30
+  struct fuse_conn_info conn;
+  struct fuse_config cfg;
+  memset(&conn, 0, sizeof(conn));
+  memset(&cfg, 0, sizeof(cfg));
+  fat_init(&conn, &cfg);
+#else
+  struct fuse_conn_info conn;
+  memset(&conn, 0, sizeof(conn));
+  fat_init(&conn);
+#endif
+
+  memset(counts, 0, sizeof(counts));
+  for (op = 0; op < TRACE_OPS; op++) {
+    capacities[op] = 256;
+    latencies[op] = malloc(sizeof(uint32_t) * capacities[op]);
+    recorded[op] = malloc(sizeof(uint32_t) * capacities[op]);
+  }
+
+  uint64_t replay_start = trace_now();
+  while (fread(&record, sizeof(record), 1, in) == 1) {
+    char path[record.path_length + 1], to[record.to_length + 1];
+    if (fread(path, 1, record.path_length, in) != record.path_length ||
+        fread(to, 1, record.to_length, in) != record.to_length || record.op >= TRACE_OPS)
+      break;
+    path[record.path_length] = '\0';
+    to[record.to_length] = '\0';
+    if ((record.op == TRACE_READ || record.op == TRACE_WRITE) && record.size > data_size) {
+      data_size = record.size;
+      data = realloc(data, data_size);
+      memset(data, 0x5A, data_size);
+    }
+
+    uint64_t start = trace_now();
+    int ret = replay_call(&record, path, to, data);
+    uint64_t duration = trace_now() - start;
+
+    op = record.op;
+    if (counts[op] == capacities[op]) {
+      capacities[op] *= 2;
+      latencies[op] = realloc(latencies[op], sizeof(uint32_t) * capacities[op]);
+      recorded[op] = realloc(recorded[op], sizeof(uint32_t) * capacities[op]);
+    }
+    latencies[op][counts[op]] = duration > UINT32_MAX ? UINT32_MAX : duration;
+    recorded[op][counts[op]] = record.duration;
+    counts[op]++;
+    differ += ret != record.result;
+    n++;
+  }
+  uint64_t replay_time = trace_now() - replay_start;
+  fclose(in);
+  fat_destroy(NULL);
+
+  printf("%zu operations replayed in %.3f s, %zu with another result than recorded\n",
+         n, replay_time / 1e9, differ);
+  printf("%-9s %9s %10s %10s %10s %10s %12s %12s\n", "op", "count", "p50 us", "p90 us", "p99 us", "max us", "rec p50 us", "rec p99 us");
+  for (op = 0; op < TRACE_OPS; op++) {
+    size_t c = counts[op];
+    if (c > 0) {
+      qsort(latencies[op], c, sizeof(uint32_t), compare_latency);
+      qsort(recorded[op], c, sizeof(uint32_t), compare_latency);
+      printf("%-9s %9zu %10.1f %10.1f %10.1f %10.1f %12.1f %12.1f\n", trace_op_names[op], c,
+             percentile(latencies[op], c, 50) / 1e3, percentile(latencies[op], c, 90) / 1e3,
+             percentile(latencies[op], c, 99) / 1e3, latencies[op][c - 1] / 1e3,
+             percentile(recorded[op], c, 50) / 1e3, percentile(recorded[op], c, 99) / 1e3);
+    }
+    free(latencies[op]);
+    free(recorded[op]);
+  }
+  free(data);
+  return 0;
+}
+
 static struct fuse_operations fat_oper = {
     .chmod = fat_chmod,
     .chown = fat_chown,
+    .destroy = fat_destroy,
+    .flush = fat_flush,
+    .fsync = fat_fsync,
 		.mknod = fat_mknod,
     .getattr  = fat_getattr,
+    .init = fat_init,
     .mkdir = fat_mkdir,
     .open = fat_open,
     .read = fat_read,
+    .release = fat_release,
     .readdir  = fat_readdir,
+    .rename = fat_rename,
+    .statfs = fat_statfs,
     .truncate = fat_truncate,
     .utimens = fat_utimens,
     .write = fat_write,
@@ -1345,10 +5468,44 @@ int main(int argc, char *argv[])
 
   fprintf(stderr, "device : %s\n", options.device);
 
+  // Let the kernel remember misses too. First, so that an explicit
+  // -o negative_timeout wins.
+  fuse_opt_insert_arg(&args, 1, "-onegative_timeout=" NEGATIVE_TIMEOUT);
+  // ro is taken by our options, the kernel must see it too.
+  if (options.readonly)
+    fuse_opt_insert_arg(&args, 1, "-oro");
+
   debug = fopen("/tmp/debugfuse", "w+");
+  if (options.ramdisk || options.replay) {
+    device = &ram_backend;
+    ram.scratch = options.replay != NULL;
+  }
+  else if (options.odirect)
+    device = &direct_backend;
+  if (options.device == NULL || device->open(options.device) != 0) {
+    fprintf(stderr, "Cannot open device %s\n", options.device ? options.device : "(none)");
+    return -1;
+  }
+  // A replay runs on a scratch copy : the journal belongs to the real image,
+  // it is neither replayed onto the copy nor written to.
+  if (!options.replay)
+    replay_journal();
   mount_fat();
+
+  if (options.fsck) {
+    ret = run_fsck();
+    sync_fat_mirrors();
+    device->close();
+    return ret;
+  }
+  if (options.readonly && ro_index.nodes == NULL) {
+    build_ro_index();
+    save_index();
+  }
+  if (options.replay)
+    return run_replay();
   
-  ret = fuse_main(args.argc, args.argv, &fat_oper, fat_data);
+  ret = fuse_main(args.argc, args.argv, options.trace ? &traced_oper : &fat_oper, fat_data);
   fuse_opt_free_args(&args);
 
   return ret;
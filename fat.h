@@ -2,6 +2,8 @@
 #define __FAT_H__
 
 #include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 typedef struct _fat_BS {
 // Boot Sector
@@ -52,6 +54,55 @@ typedef struct _fat_extended_BIOS_32 {
   uint16_t  boot_sector_sign;    //0x1fe
 } __attribute__ ((packed)) fat_extended_BIOS_32_t;
 
+typedef struct _fat_fs_info {
+// FS Information Sector (FAT32)
+  uint32_t  lead_signature;      //0x000 : 0x41615252
+  uint8_t   reserved[480];       //0x004
+  uint32_t  struct_signature;    //0x1e4 : 0x61417272
+  uint32_t  free_count;          //0x1e8 : 0xFFFFFFFF if unknown
+  uint32_t  next_free;           //0x1ec : 0xFFFFFFFF if unknown
+  uint8_t   reserved2[12];       //0x1f0
+  uint32_t  trail_signature;     //0x1fc : 0xAA550000
+} __attribute__ ((packed)) fat_fs_info_t;
+
+#define FS_INFO_LEAD_SIGNATURE   0x41615252
+#define FS_INFO_STRUCT_SIGNATURE 0x61417272
+#define FS_INFO_TRAIL_SIGNATURE  0xAA550000
+#define FS_INFO_UNKNOWN          0xFFFFFFFF
+
+// Block device backend. Offsets are in bytes from the start of the volume.
+typedef struct _block_backend {
+  const char *name;
+  int     (*open)(const char *path);
+  ssize_t (*read)(void *buf, size_t count, off_t offset);
+  ssize_t (*write)(const void *buf, size_t count, off_t offset);
+  ssize_t (*readv)(const struct iovec *iov, int iovcnt, off_t offset);
+  ssize_t (*writev)(const struct iovec *iov, int iovcnt, off_t offset);
+  int     (*flush)();
+  off_t   (*size)();
+  void    (*close)();
+} block_backend_t;
+
+// Record of the metadata intent log : a header followed by length bytes
+// of data to write at offset. A transaction ends with a JOURNAL_COMMIT record.
+typedef struct _journal_record {
+  uint32_t  magic;
+  uint32_t  type;
+  uint64_t  offset;
+  uint32_t  length;
+  uint32_t  checksum;            // of the header (checksum = 0) and the data
+} __attribute__ ((packed)) journal_record_t;
+
+#define JOURNAL_MAGIC  0x4C4E524A // "JRNL"
+#define JOURNAL_WRITE  1
+#define JOURNAL_COMMIT 2
+// A write to a FAT copy : the data starts with a 64-bit stamp taken under the
+// group locks, that orders writes of the same sector across transactions.
+#define JOURNAL_FAT_WRITE 3
+// Drops the writes logged before it over [offset, offset + the 64-bit length
+// in its data) : the clusters were metadata then, and hold file data now.
+#define JOURNAL_REVOKE 4
+
 typedef struct _fat_time {
   unsigned int seconds2 : 5;
   unsigned int minutes : 6;
@@ -92,8 +143,15 @@ typedef struct {
   uint8_t   filename3[4];
 }__attribute__((packed)) lfn_entry_t;
 
+// A long name spans at most 20 entries of 13 UTF-16 code units, each of
+// which takes at most 3 bytes in UTF-8.
+#define LFN_MAX_ENTRIES 20
+#define LFN_MAX_UNITS 255
+#define LFN_NAME_MAX (LFN_MAX_ENTRIES * 13 * 3 + 1)
+
 typedef struct _directory_entry {
-  char name[256];
+  char name[LFN_NAME_MAX];
+  uint32_t hash;           // of the case folded name
   uint8_t attributes;
   uint32_t size;
   time_t access_time;
@@ -110,12 +168,164 @@ typedef struct _directory {
   uint32_t cluster;
 } directory_t;
 
+// Position in a directory, decoded one cluster at a time.
+typedef struct _dir_iter {
+  int cluster;             // first cluster, -1 for the FAT12/16 root directory
+  int current;             // cluster held in entries
+  int slot;                // next slot to decode
+  int n_slots;             // slots per cluster
+  int first;               // slot number of entries[0], -1 if nothing loaded
+  fat_dir_entry_t *entries;
+} dir_iter_t;
+
+typedef struct _sfn_node {
+  char name[11];
+  struct _sfn_node *next;
+} sfn_node_t;
+
+// Slot usage of one directory, kept across calls so that new entries can be
+// placed without reading the directory again.
+typedef struct _dir_slots {
+  char *path;
+  int cluster;             // first cluster, -1 for the FAT12/16 root directory
+  uint32_t *clusters;      // cluster chain of the directory
+  int n_clusters;
+  int n_slots;             // capacity in 32 bytes entries
+  uint8_t *used;           // one byte per slot
+  int end;                 // append cursor : first slot of the free tail
+  int holes;               // deleted slots before the cursor
+  int holes_scanned;       // value of holes when a scan last found no run
+  sfn_node_t **sfn_buckets; // short names in use, for numeric-tail generation
+  int sfn_n_buckets;
+  int sfn_count;
+  struct _dir_slots *next;
+} dir_slots_t;
+
+// Read-only index (-o ro) : every file and directory of the volume, built
+// once at mount and never modified afterwards, so that it is read without
+// any lock. Strings and links are offsets and indexes.
+typedef struct _ro_extent {
+  uint32_t cluster;        // first cluster of the run
+  uint32_t count;          // clusters in the run
+  uint32_t offset;         // position of the run in the file, in clusters
+} ro_extent_t;
+
+typedef struct _ro_node {
+  uint32_t path;           // full path, offset in the string pool
+  uint32_t name;           // last component, offset in the string pool
+  uint32_t hash;           // of the case folded path
+  uint32_t parent;
+  uint8_t attributes;
+  uint32_t size;
+  int64_t access_time;
+  int64_t modification_time;
+  int64_t creation_time;
+  uint32_t first;          // directories : first child, files : first extent
+  uint32_t count;          // number of children or extents
+} ro_node_t;
+
+typedef struct _ro_index {
+  ro_node_t *nodes;        // breadth first : the children of a directory follow each other
+  uint32_t n_nodes;
+  ro_extent_t *extents;
+  uint32_t n_extents;
+  char *strings;
+  uint32_t strings_size;
+  uint32_t *buckets;       // by path hash, node index + 1 (0 : empty)
+  uint32_t n_buckets;      // a power of two
+} ro_index_t;
+
+// Sidecar index file (-o index=FILE) : the decoded FAT and the read-only
+// index, saved by a read-only mount and mapped back as is by the next mount
+// of the same image. Sections are 8 bytes aligned.
+#define INDEX_MAGIC 0x58444E49   // "INDX"
+#define INDEX_VERSION 1
+
+typedef struct _index_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t volume_id;
+  uint32_t total_data_clusters;
+  uint64_t fat_checksum;       // of the raw first FAT
+  uint32_t n_nodes;
+  uint32_t n_extents;
+  uint32_t strings_size;
+  uint32_t n_buckets;
+  uint64_t fat_offset;         // total_data_clusters + 3 decoded entries
+  uint64_t nodes_offset;
+  uint64_t extents_offset;
+  uint64_t strings_offset;
+  uint64_t buckets_offset;
+  uint64_t size;               // of the whole file
+} index_header_t;
+
+// Trace of the FUSE operations (-o trace=FILE) : a header, then per call a
+// record followed by its path, and by the new path for a rename. Replayed by
+// -replay=FILE.
+#define TRACE_MAGIC 0x43525446   // "FTRC"
+#define TRACE_VERSION 1
+
+typedef enum {
+  TRACE_GETATTR,
+  TRACE_READDIR,
+  TRACE_OPEN,
+  TRACE_READ,
+  TRACE_WRITE,
+  TRACE_MKNOD,
+  TRACE_MKDIR,
+  TRACE_UNLINK,
+  TRACE_RENAME,
+  TRACE_UTIMENS,
+  TRACE_CHMOD,
+  TRACE_CHOWN,
+  TRACE_TRUNCATE,
+  TRACE_STATFS,
+  TRACE_FLUSH,
+  TRACE_FSYNC,
+  TRACE_RELEASE,
+  TRACE_OPS
+} trace_op_t;
+
+typedef struct _trace_header {
+  uint32_t magic;
+  uint32_t version;
+} trace_header_t;
+
+typedef struct _trace_record {
+  uint8_t op;
+  uint8_t reserved;
+  uint16_t thread;         // small number of the calling thread
+  uint16_t path_length;
+  uint16_t to_length;      // rename only
+  uint32_t mode;           // mknod, mkdir, chmod mode, open/release flags, rename flags, fsync datasync
+  uint32_t size;           // read, write ; readdir : entries returned
+  uint64_t offset;         // read, write, readdir ; truncate : length
+  uint64_t start;          // ns since the trace began
+  uint32_t duration;       // ns
+  int32_t result;
+} __attribute__((packed)) trace_record_t;
+
 typedef enum {
   FAT12,
   FAT16,
   FAT32
 } fat_t;
 
+// fat_table.c : kernels unpacking a FAT to one entry per uint32_t and packing
+// it back (n entries, even for FAT12). fat_codecs lists the variants of a
+// FAT type, best first, the scalar reference last; fat_codec is the best one
+// this CPU runs.
+typedef struct _fat_codec {
+  const char *name;
+  const char *isa;         // instruction set it needs, NULL for none
+  void (*decode)(const uint8_t *src, uint32_t *dst, size_t n);
+  void (*encode)(const uint32_t *src, uint8_t *dst, size_t n);
+} fat_codec_t;
+
+int fat_codecs(fat_t type, const fat_codec_t **codecs);
+int fat_codec_supported(const fat_codec_t *codec);
+const fat_codec_t * fat_codec(fat_t type);
+
 typedef struct _fat_info {
   fat_BS_t BS;
   fat_extended_BIOS_16_t *ext_BIOS_16;
@@ -127,6 +337,12 @@ typedef struct _fat_info {
   unsigned int total_data_clusters;
   unsigned int table_size;
   fat_t fat_type;
+  unsigned int free_clusters; // number of free data clusters
+  unsigned int next_free;     // where the next allocation starts looking
+  int fs_info_dirty;          // FSInfo sector needs to be written back
+  unsigned int active_fat;    // copy read at mount and always written
+  int mirror_fat;             // the other copies follow it
+  uint8_t *mirror_dirty;      // lazy mirroring : sectors the mirrors lag behind on
 } fat_info_t;
 
 
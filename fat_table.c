@@ -0,0 +1,256 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "fat.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FAT_TABLE_X86
+#endif
+
+// Kernels converting a FAT between its on-disk packing and one uint32_t per
+// entry. The scalar ones are the reference, the others are checked against
+// them by bench_fat_table. FAT12 packs two entries in three bytes, so n is
+// even there.
+
+static void decode12_scalar(const uint8_t *src, uint32_t *dst, size_t n) {
+  size_t i;
+  for (i = 0; i + 1 < n; i += 2, src += 3) {
+    uint32_t tmp = src[0] + (src[1] << 8) + (src[2] << 16);
+    dst[i] = tmp & 0xFFF;
+    dst[i + 1] = tmp >> 12;
+  }
+}
+
+static void encode12_scalar(const uint32_t *src, uint8_t *dst, size_t n) {
+  size_t i;
+  for (i = 0; i + 1 < n; i += 2, dst += 3) {
+    uint32_t tmp = ((src[i + 1] & 0xFFF) << 12) + (src[i] & 0xFFF);
+    dst[0] = tmp & 0xFF;
+    dst[1] = (tmp >> 8) & 0xFF;
+    dst[2] = (tmp >> 16) & 0xFF;
+  }
+}
+
+static void decode16_scalar(const uint8_t *src, uint32_t *dst, size_t n) {
+  size_t i;
+  for (i = 0; i < n; i++)
+    dst[i] = src[i * 2] + (src[i * 2 + 1] << 8);
+}
+
+static void encode16_scalar(const uint32_t *src, uint8_t *dst, size_t n) {
+  size_t i;
+  for (i = 0; i < n; i++) {
+    dst[i * 2] = src[i] & 0xFF;
+    dst[i * 2 + 1] = (src[i] >> 8) & 0xFF;
+  }
+}
+
+static void decode32_scalar(const uint8_t *src, uint32_t *dst, size_t n) {
+  size_t i;
+  for (i = 0; i < n; i++)
+    dst[i] = src[i * 4] + (src[i * 4 + 1] << 8) + (src[i * 4 + 2] << 16) + ((uint32_t) src[i * 4 + 3] << 24);
+}
+
+static void encode32_scalar(const uint32_t *src, uint8_t *dst, size_t n) {
+  size_t i;
+  for (i = 0; i < n; i++) {
+    dst[i * 4] = src[i] & 0xFF;
+    dst[i * 4 + 1] = (src[i] >> 8) & 0xFF;
+    dst[i * 4 + 2] = (src[i] >> 16) & 0xFF;
+    dst[i * 4 + 3] = (src[i] >> 24) & 0xFF;
+  }
+}
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+// FAT32 entries are already little endian words : a copy, left to libc.
+static void decode32_copy(const uint8_t *src, uint32_t *dst, size_t n) {
+  memcpy(dst, src, n * 4);
+}
+
+static void encode32_copy(const uint32_t *src, uint8_t *dst, size_t n) {
+  memcpy(dst, src, n * 4);
+}
+#endif
+
+#ifdef FAT_TABLE_X86
+__attribute__ ((target ("sse2")))
+static void decode16_sse2(const uint8_t *src, uint32_t *dst, size_t n) {
+  const __m128i zero = _mm_setzero_si128();
+  size_t i;
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + i * 2));
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_unpacklo_epi16(v, zero));
+    _mm_storeu_si128((__m128i*)(dst + i + 4), _mm_unpackhi_epi16(v, zero));
+  }
+  decode16_scalar(src + i * 2, dst + i, n - i);
+}
+
+// The low halves are sign extended first, so that the saturating pack keeps
+// them as they are.
+__attribute__ ((target ("sse2")))
+static void encode16_sse2(const uint32_t *src, uint8_t *dst, size_t n) {
+  size_t i;
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(src + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(src + i + 4));
+    a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+    b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+    _mm_storeu_si128((__m128i*)(dst + i * 2), _mm_packs_epi32(a, b));
+  }
+  encode16_scalar(src + i, dst + i * 2, n - i);
+}
+
+__attribute__ ((target ("avx2")))
+static void decode16_avx2(const uint8_t *src, uint32_t *dst, size_t n) {
+  size_t i;
+  for (i = 0; i + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(src + i * 2));
+    __m128i b = _mm_loadu_si128((const __m128i*)(src + i * 2 + 16));
+    _mm256_storeu_si256((__m256i*)(dst + i), _mm256_cvtepu16_epi32(a));
+    _mm256_storeu_si256((__m256i*)(dst + i + 8), _mm256_cvtepu16_epi32(b));
+  }
+  decode16_scalar(src + i * 2, dst + i, n - i);
+}
+
+__attribute__ ((target ("avx2")))
+static void encode16_avx2(const uint32_t *src, uint8_t *dst, size_t n) {
+  size_t i;
+  for (i = 0; i + 16 <= n; i += 16) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(src + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(src + i + 8));
+    a = _mm256_srai_epi32(_mm256_slli_epi32(a, 16), 16);
+    b = _mm256_srai_epi32(_mm256_slli_epi32(b, 16), 16);
+    // The pack works within 128 bits lanes : put the quarters back in order.
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8);
+    _mm256_storeu_si256((__m256i*)(dst + i * 2), packed);
+  }
+  encode16_scalar(src + i, dst + i * 2, n - i);
+}
+
+// Eight entries from 12 bytes : each 16 bits lane gets the two bytes holding
+// its entry, even entries keep their low 12 bits, odd ones their high 12.
+__attribute__ ((target ("ssse3")))
+static void decode12_ssse3(const uint8_t *src, uint32_t *dst, size_t n) {
+  const __m128i shuffle = _mm_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11);
+  const __m128i even = _mm_set1_epi32(0x00000FFF);
+  const __m128i odd = _mm_set1_epi32((int) 0xFFF00000);
+  const __m128i zero = _mm_setzero_si128();
+  size_t i;
+  // 16 bytes are loaded for 12 : stop early enough not to read past src.
+  for (i = 0; i + 16 <= n; i += 8) {
+    __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + i / 2 * 3)), shuffle);
+    v = _mm_or_si128(_mm_and_si128(v, even), _mm_srli_epi16(_mm_and_si128(v, odd), 4));
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_unpacklo_epi16(v, zero));
+    _mm_storeu_si128((__m128i*)(dst + i + 4), _mm_unpackhi_epi16(v, zero));
+  }
+  decode12_scalar(src + i / 2 * 3, dst + i, n - i);
+}
+
+// Pairs are joined in 64 bits lanes, then their three bytes gathered.
+__attribute__ ((target ("ssse3")))
+static void encode12_ssse3(const uint32_t *src, uint8_t *dst, size_t n) {
+  const __m128i low = _mm_set_epi32(0, 0xFFF, 0, 0xFFF);
+  const __m128i high = _mm_set_epi32(0xFFF, 0, 0xFFF, 0);
+  const __m128i gather_a = _mm_setr_epi8(0, 1, 2, 8, 9, 10, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i gather_b = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 0, 1, 2, 8, 9, 10, -1, -1, -1, -1);
+  size_t i;
+  // 16 bytes are stored for 12 : stop early enough not to write past dst.
+  for (i = 0; i + 16 <= n; i += 8) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(src + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(src + i + 4));
+    a = _mm_or_si128(_mm_and_si128(a, low), _mm_srli_epi64(_mm_and_si128(a, high), 20));
+    b = _mm_or_si128(_mm_and_si128(b, low), _mm_srli_epi64(_mm_and_si128(b, high), 20));
+    __m128i v = _mm_or_si128(_mm_shuffle_epi8(a, gather_a), _mm_shuffle_epi8(b, gather_b));
+    _mm_storeu_si128((__m128i*)(dst + i / 2 * 3), v);
+  }
+  encode12_scalar(src + i, dst + i / 2 * 3, n - i);
+}
+
+// As decode12_ssse3, twice per iteration : the shuffle works within 128 bits
+// lanes, so each lane gets its own 12 bytes.
+__attribute__ ((target ("avx2")))
+static void decode12_avx2(const uint8_t *src, uint32_t *dst, size_t n) {
+  const __m256i shuffle = _mm256_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11,
+                                           0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11);
+  const __m256i even = _mm256_set1_epi32(0x00000FFF);
+  const __m256i odd = _mm256_set1_epi32((int) 0xFFF00000);
+  size_t i;
+  for (i = 0; i + 32 <= n; i += 16) {
+    const uint8_t *p = src + i / 2 * 3;
+    __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*) p)),
+                                        _mm_loadu_si128((const __m128i*)(p + 12)), 1);
+    v = _mm256_shuffle_epi8(v, shuffle);
+    v = _mm256_or_si256(_mm256_and_si256(v, even), _mm256_srli_epi16(_mm256_and_si256(v, odd), 4));
+    _mm256_storeu_si256((__m256i*)(dst + i), _mm256_cvtepu16_epi32(_mm256_castsi256_si128(v)));
+    _mm256_storeu_si256((__m256i*)(dst + i + 8), _mm256_cvtepu16_epi32(_mm256_extracti128_si256(v, 1)));
+  }
+  decode12_ssse3(src + i / 2 * 3, dst + i, n - i);
+}
+#endif
+
+// Best first, the scalar reference last. FAT12 has no AVX2 encoder : the
+// AVX2 variant uses the SSSE3 one.
+static const fat_codec_t codecs12[] = {
+#ifdef FAT_TABLE_X86
+  { "avx2", "avx2", decode12_avx2, encode12_ssse3 },
+  { "ssse3", "ssse3", decode12_ssse3, encode12_ssse3 },
+#endif
+  { "scalar", NULL, decode12_scalar, encode12_scalar },
+};
+
+static const fat_codec_t codecs16[] = {
+#ifdef FAT_TABLE_X86
+  { "avx2", "avx2", decode16_avx2, encode16_avx2 },
+  { "sse2", "sse2", decode16_sse2, encode16_sse2 },
+#endif
+  { "scalar", NULL, decode16_scalar, encode16_scalar },
+};
+
+static const fat_codec_t codecs32[] = {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  { "copy", NULL, decode32_copy, encode32_copy },
+#endif
+  { "scalar", NULL, decode32_scalar, encode32_scalar },
+};
+
+int fat_codecs(fat_t type, const fat_codec_t **codecs) {
+  if (type == FAT12) {
+    *codecs = codecs12;
+    return sizeof(codecs12) / sizeof(codecs12[0]);
+  } else if (type == FAT16) {
+    *codecs = codecs16;
+    return sizeof(codecs16) / sizeof(codecs16[0]);
+  } else {
+    *codecs = codecs32;
+    return sizeof(codecs32) / sizeof(codecs32[0]);
+  }
+}
+
+int fat_codec_supported(const fat_codec_t *codec) {
+  if (codec->isa == NULL)
+    return 1;
+#ifdef FAT_TABLE_X86
+  if (strcmp(codec->isa, "avx2") == 0)
+    return __builtin_cpu_supports("avx2");
+  if (strcmp(codec->isa, "ssse3") == 0)
+    return __builtin_cpu_supports("ssse3");
+  if (strcmp(codec->isa, "sse2") == 0)
+    return __builtin_cpu_supports("sse2");
+#endif
+  return 0;
+}
+
+const fat_codec_t * fat_codec(fat_t type) {
+  static const fat_codec_t *best[3];
+  const fat_codec_t *codecs;
+  int n, i;
+
+  if (best[type])
+    return best[type];
+  n = fat_codecs(type, &codecs);
+  for (i = 0; i < n - 1 && !fat_codec_supported(&codecs[i]); i++)
+    ;
+  best[type] = &codecs[i];
+  return best[type];
+}